@@ -0,0 +1,26 @@
+/* Name: avr/eeprom.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * License: GPL
+ *
+ * EEMEM variables are placed in a section of their own. Their offset
+ * within that section is their eeprom address, the contents are kept
+ * in an eeprom image file by the emulator.
+ */
+
+#ifndef EMU_AVR_EEPROM_H
+#define EMU_AVR_EEPROM_H
+
+#include <stdint.h>
+#include "emu.h"
+
+#define EEMEM  __attribute__ ((section ("emu_eeprom")))
+
+extern uint8_t __start_emu_eeprom[];
+
+#define EMU_EEPROM_ADDR(p)  ((uint16_t)((const uint8_t *)(p) - __start_emu_eeprom))
+
+#define eeprom_read_byte(p)     emu_eeprom_read(EMU_EEPROM_ADDR(p))
+#define eeprom_write_byte(p, v) emu_eeprom_write(EMU_EEPROM_ADDR(p), (v))
+#define eeprom_is_ready()       emu_eeprom_ready()
+
+#endif /* EMU_AVR_EEPROM_H */
@@ -0,0 +1,14 @@
+/* Name: avr/interrupt.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * License: GPL
+ *
+ * The emulator has no interrupts, usb requests are delivered from usbPoll()
+ */
+
+#ifndef EMU_AVR_INTERRUPT_H
+#define EMU_AVR_INTERRUPT_H
+
+#define sei()
+#define cli()
+
+#endif /* EMU_AVR_INTERRUPT_H */
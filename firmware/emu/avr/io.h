@@ -0,0 +1,80 @@
+/* Name: avr/io.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * Fake ATmega8 register definitions. Every register access is routed
+ * through emu_io() so the emulator can react on port changes. The
+ * registers are laid out like on the real device, so the DDR() and PIN()
+ * address arithmetic of lcd.c keeps working.
+ */
+
+#ifndef EMU_AVR_IO_H
+#define EMU_AVR_IO_H
+
+#include <stdint.h>
+#include "emu.h"
+
+#define _BV(bit)      (1 << (bit))
+
+#define _SFR_IO8(a)   (*emu_io(a))
+#define _SFR_IO16(a)  (*emu_io16(a))
+
+#define PIND    _SFR_IO8(EMU_PIND)
+#define DDRD    _SFR_IO8(EMU_DDRD)
+#define PORTD   _SFR_IO8(EMU_PORTD)
+#define PINC    _SFR_IO8(EMU_PINC)
+#define DDRC    _SFR_IO8(EMU_DDRC)
+#define PORTC   _SFR_IO8(EMU_PORTC)
+#define PINB    _SFR_IO8(EMU_PINB)
+#define DDRB    _SFR_IO8(EMU_DDRB)
+#define PORTB   _SFR_IO8(EMU_PORTB)
+
+#define OCR2    _SFR_IO8(EMU_OCR2)
+#define TCNT2   _SFR_IO8(EMU_TCNT2)
+#define TCCR2   _SFR_IO8(EMU_TCCR2)
+#define OCR1B   _SFR_IO16(EMU_OCR1B)
+#define OCR1A   _SFR_IO16(EMU_OCR1A)
+#define TCNT1   _SFR_IO16(EMU_TCNT1)
+#define TCCR1B  _SFR_IO8(EMU_TCCR1B)
+#define TCCR1A  _SFR_IO8(EMU_TCCR1A)
+#define TCNT0   _SFR_IO8(EMU_TCNT0)
+#define TCCR0   _SFR_IO8(EMU_TCCR0)
+#define TIFR    _SFR_IO8(EMU_TIFR)
+#define TIMSK   _SFR_IO8(EMU_TIMSK)
+
+/* TCCR1A */
+#define COM1A1  7
+#define COM1A0  6
+#define COM1B1  5
+#define COM1B0  4
+#define WGM11   1
+#define WGM10   0
+
+/* TCCR1B */
+#define WGM13   4
+#define WGM12   3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+
+/* TCCR2 */
+#define WGM20   6
+#define COM21   5
+#define COM20   4
+#define WGM21   3
+#define CS22    2
+#define CS21    1
+#define CS20    0
+
+/* TCCR0 */
+#define CS02    2
+#define CS01    1
+#define CS00    0
+
+/* TIFR/TIMSK */
+#define OCF2    7
+#define TOV2    6
+#define TOV0    0
+
+#endif /* EMU_AVR_IO_H */
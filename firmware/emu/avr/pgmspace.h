@@ -0,0 +1,15 @@
+/* Name: avr/pgmspace.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * License: GPL
+ *
+ * The host has a single address space, flash is just memory
+ */
+
+#ifndef EMU_AVR_PGMSPACE_H
+#define EMU_AVR_PGMSPACE_H
+
+#define PROGMEM
+#define PSTR(s)             (s)
+#define pgm_read_byte(p)    (*(const unsigned char *)(p))
+
+#endif /* EMU_AVR_PGMSPACE_H */
@@ -0,0 +1,14 @@
+/* Name: avr/wdt.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * License: GPL
+ */
+
+#ifndef EMU_AVR_WDT_H
+#define EMU_AVR_WDT_H
+
+#define WDTO_1S          6
+
+#define wdt_enable(t)
+#define wdt_reset()
+
+#endif /* EMU_AVR_WDT_H */
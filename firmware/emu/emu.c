@@ -0,0 +1,352 @@
+/* Name: emu.c
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * Emulated ATmega8 environment for the LCD2USB firmware: i/o registers,
+ * eeprom and the two lcd controllers on the E0/E1 lines. The firmware's
+ * main() is renamed to firmware_main() by the Makefile and started from
+ * here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <avr/io.h>
+
+#include "emu.h"
+#include "hd44780.h"
+#include "lcd.h"
+
+extern int firmware_main(void);
+extern int emu_usb_fd, emu_usb_realtime;
+extern unsigned long emu_usb_setups, emu_usb_naks, emu_usb_refused;
+extern uint64_t emu_usb_cycles, emu_usb_max, emu_usb_ready;
+
+uint64_t emu_cycle = 0;
+uint8_t emu_keys = 0;
+
+static uint8_t io[EMU_IO_SIZE];
+static uint16_t io16[EMU_IO_SIZE];
+static uint8_t last_portc = 0;
+
+static struct hd44780 lcd[2];
+static uint8_t lcd_drive[2];       /* nibble driven by controller */
+
+#define EEPROM_SIZE 512
+static uint8_t eeprom[EEPROM_SIZE];
+static int eeprom_fd = -1;
+static uint64_t eeprom_busy = 0;   /* cycle the current write completes */
+static unsigned long eeprom_writes = 0;
+
+/* an eeprom write takes 8.5ms on the ATmega8, the cpu keeps running */
+/* meanwhile */
+#define EEPROM_WRITE_CYCLES  (EMU_F_CPU * 85 / 10000)
+
+/* lcd lines, see lcd.h */
+#define RS_BIT   _BV(LCD_RS_PIN)   /* PORTD */
+#define RW_BIT   _BV(LCD_RW_PIN)   /* PORTC */
+#define E0_BIT   _BV(LCD_E0_PIN)   /* PORTC */
+#define E1_BIT   _BV(LCD_E1_PIN)   /* PORTC */
+
+/* each register access is counted as one cycle */
+#define IO_CYCLES  1
+
+/* update input registers from outputs and attached hardware */
+static void emu_pins(void) {
+  uint8_t pind = io[EMU_PORTD];
+  uint8_t e = io[EMU_PORTC];
+  int c;
+
+  /* controllers in read mode drive DB7..DB4 */
+  if(io[EMU_PORTC] & RW_BIT) {
+    for(c=0;c<2;c++) {
+      if((e & (c?E1_BIT:E0_BIT)) && lcd[c].present) 
+	pind = (pind & 0x0f) | (lcd_drive[c] << 4);
+    }
+  }
+
+  io[EMU_PIND] = pind;
+
+  /* keys pull the pins low, pullups pull them high */
+  io[EMU_PINC] = (io[EMU_PORTC] & ~_BV(5)) | ((emu_keys & 1)?0:_BV(5));
+  io[EMU_PINB] = (io[EMU_PORTB] & ~_BV(0)) | ((emu_keys & 2)?0:_BV(0));
+}
+
+/* timers 0 and 2 count in normal mode, overflow flags and compare */
+/* units are not emulated */
+static const uint16_t t0_prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+static const uint16_t t2_prescale[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+static uint64_t timer_cycle = 0;   /* cycles the timers have seen */
+static uint64_t t0_rest = 0, t2_rest = 0;
+
+static void emu_timer(uint8_t tcnt, uint16_t prescale, uint64_t *rest, 
+		      uint64_t cycles) {
+  if(!prescale) {
+    *rest = 0;
+    return;
+  }
+
+  *rest += cycles;
+  io[tcnt] += *rest / prescale;
+  *rest %= prescale;
+}
+
+/* scripted key presses: key state changes at given times */
+#define KEY_SCRIPT_MAX 32
+static struct { uint64_t cycle; uint8_t keys; } key_script[KEY_SCRIPT_MAX];
+static int key_script_len = 0, key_script_pos = 0;
+
+/* parse "ms:keys,ms:keys,..." */
+static int emu_key_script(const char *arg) {
+  unsigned ms, keys;
+  int n;
+
+  while(*arg && (key_script_len < KEY_SCRIPT_MAX)) {
+    if(sscanf(arg, "%u:%u%n", &ms, &keys, &n) != 2)
+      return -1;
+
+    key_script[key_script_len].cycle = (uint64_t)ms * (EMU_F_CPU / 1000);
+    key_script[key_script_len++].keys = keys;
+    arg += n;
+    if(*arg == ',')
+      arg++;
+  }
+  return 0;
+}
+
+void emu_sync(void) {
+  uint8_t portc = io[EMU_PORTC];
+  int rs = (io[EMU_PORTD] & RS_BIT)?1:0;
+  int c;
+
+  emu_timer(EMU_TCNT0, t0_prescale[io[EMU_TCCR0] & 7], &t0_rest, 
+	    emu_cycle - timer_cycle);
+  emu_timer(EMU_TCNT2, t2_prescale[io[EMU_TCCR2] & 7], &t2_rest, 
+	    emu_cycle - timer_cycle);
+  timer_cycle = emu_cycle;
+
+  while((key_script_pos < key_script_len) &&
+	(key_script[key_script_pos].cycle <= emu_cycle))
+    emu_keys = key_script[key_script_pos++].keys;
+
+  for(c=0;c<2;c++) {
+    uint8_t ebit = c?E1_BIT:E0_BIT;
+
+    /* rising edge in read mode: controller puts next nibble on bus */
+    if((portc & ebit) && !(last_portc & ebit) && (portc & RW_BIT))
+      lcd_drive[c] = hd44780_read_nibble(&lcd[c], rs, emu_cycle);
+
+    /* falling edge in write mode: controller latches nibble */
+    if(!(portc & ebit) && (last_portc & ebit) && !(portc & RW_BIT))
+      hd44780_write_nibble(&lcd[c], rs, io[EMU_PORTD] >> 4, emu_cycle);
+  }
+
+  last_portc = portc;
+  emu_pins();
+}
+
+volatile uint8_t *emu_io(uint8_t addr) {
+  emu_sync();
+  emu_cycle += IO_CYCLES;
+  return &io[addr];
+}
+
+volatile uint16_t *emu_io16(uint8_t addr) {
+  emu_sync();
+  emu_cycle += 2*IO_CYCLES;
+  return &io16[addr];
+}
+
+void emu_cycles(uint32_t cycles) {
+  emu_sync();
+  emu_cycle += cycles;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int emu_eeprom_ready(void) {
+  emu_cycles(IO_CYCLES);
+  return emu_cycle >= eeprom_busy;
+}
+
+/* reads and writes wait for a write in progress like avr-libc does */
+static void emu_eeprom_wait(void) {
+  if(emu_cycle < eeprom_busy)
+    emu_cycles(eeprom_busy - emu_cycle);
+}
+
+uint8_t emu_eeprom_read(uint16_t addr) {
+  emu_eeprom_wait();
+  return eeprom[addr % EEPROM_SIZE];
+}
+
+void emu_eeprom_write(uint16_t addr, uint8_t value) {
+  emu_eeprom_wait();
+
+  addr %= EEPROM_SIZE;
+  eeprom[addr] = value;
+  eeprom_busy = emu_cycle + EEPROM_WRITE_CYCLES;
+  eeprom_writes++;
+
+  if((eeprom_fd >= 0) && (pwrite(eeprom_fd, &value, 1, addr) != 1))
+    perror("eeprom write");
+}
+
+static void emu_eeprom_open(const char *name) {
+  /* unprogrammed eeprom reads as 0xff */
+  memset(eeprom, 0xff, sizeof(eeprom));
+
+  if(!name)
+    return;
+
+  if((eeprom_fd = open(name, O_RDWR | O_CREAT, 0644)) < 0) {
+    perror(name);
+    exit(1);
+  }
+
+  if(read(eeprom_fd, eeprom, sizeof(eeprom)) < (ssize_t)sizeof(eeprom)) {
+    /* new image: fill with erased contents */
+    memset(eeprom, 0xff, sizeof(eeprom));
+    if(pwrite(eeprom_fd, eeprom, sizeof(eeprom), 0) != sizeof(eeprom))
+      perror(name);
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int show_rows = 0, show_cols = 0;
+
+/* print the visible display contents */
+static void emu_show(void) {
+  int r, i, c, a;
+
+  for(r=0;r<show_rows;r++) {
+    /* dual controller displays use one controller per two lines */
+    c = (lcd[1].present && (r > 1))?1:0;
+    a = (c || r < 2)?0:show_cols;
+
+    fprintf(stderr, "|");
+    for(i=0;i<show_cols;i++) {
+      uint8_t ch = hd44780_visible(&lcd[c], r & 1, a+i);
+      fputc(((ch >= 32) && (ch < 127))?ch:'?', stderr);
+    }
+    fprintf(stderr, "|\n");
+  }
+}
+
+#define US(cycles)  ((cycles) * 1000000.0 / EMU_F_CPU)
+
+/* print where the lcd controller time went */
+static void emu_lcd_stats(int c) {
+  struct hd44780_stat *st;
+  int op;
+
+  fprintf(stderr, "emu: ctrl%d   count  busy polls  polls/op  stall us/op"
+	  "  lost\n", c);
+
+  for(op=0;op<HD44780_OPS;op++) {
+    st = &lcd[c].stat[op];
+    if(!st->count && !st->lost)
+      continue;
+
+    fprintf(stderr, "emu: %-8s %6lu  %10lu  %8.2f  %11.1f  %4lu\n",
+	    hd44780_op_name(op), st->count, st->polls, 
+	    st->count?(double)st->polls/st->count:0,
+	    st->count?US(st->wait)/st->count:0, st->lost);
+  }
+}
+
+/* called by the usb driver shim once the host has disconnected */
+void emu_exit(void) {
+  int c;
+
+  emu_sync();
+
+  fprintf(stderr, "emu: %.3f ms cpu time, %lu setup requests "
+	  "(%.3f ms in usb callbacks, max %.1f us)\n", 
+	  US(emu_cycle) / 1000, emu_usb_setups,
+	  US(emu_usb_cycles) / 1000, US(emu_usb_max));
+
+  fprintf(stderr, "emu: usb polled %.3f ms after power-on\n",
+	  US(emu_usb_ready) / 1000);
+
+  fprintf(stderr, "emu: contrast pwm %u, brightness pwm %u\n", 
+	  io16[EMU_OCR1A], io16[EMU_OCR1B]);
+
+  if(eeprom_writes)
+    fprintf(stderr, "emu: %lu eeprom writes\n", eeprom_writes);
+
+  if(emu_usb_naks)
+    fprintf(stderr, "emu: %lu polls with data packets refused by flow control\n",
+	    emu_usb_naks);
+
+  if(emu_usb_refused)
+    fprintf(stderr, "emu: %lu setup packets refused by flow control, a real "
+	    "device would break\n", emu_usb_refused);
+
+  for(c=0;c<2;c++)
+    if(lcd[c].present)
+      emu_lcd_stats(c);
+
+  emu_show();
+  exit(0);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-c controllers] [-e eeprom] [-s COLSxROWS] "
+	  "[-f fd] [-r] [-k ms:keys,...]\n", name);
+  fprintf(stderr, "  -c n        number of lcd controllers (0..2, default 1)\n");
+  fprintf(stderr, "  -e file     eeprom image file\n");
+  fprintf(stderr, "  -s 20x4     print display contents at exit\n");
+  fprintf(stderr, "  -f fd       file descriptor connected to the host "
+	  "(default 0)\n");
+  fprintf(stderr, "  -r          don't run ahead of real time\n");
+  fprintf(stderr, "  -k 500:1,.. set key bitmap at the given times in ms\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int c, ctrls = 1;
+  char *eeprom_name = NULL;
+
+  while((c = getopt(argc, argv, "c:e:s:f:rk:")) != -1) {
+    switch(c) {
+    case 'c':
+      ctrls = atoi(optarg);
+      break;
+    case 'e':
+      eeprom_name = optarg;
+      break;
+    case 's':
+      if(sscanf(optarg, "%dx%d", &show_cols, &show_rows) != 2)
+	usage(argv[0]);
+      break;
+    case 'f':
+      emu_usb_fd = atoi(optarg);
+      break;
+    case 'r':
+      emu_usb_realtime = 1;
+      break;
+    case 'k':
+      if(emu_key_script(optarg) < 0)
+	usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  for(c=0;c<2;c++) {
+    lcd[c].present = (c < ctrls);
+    lcd[c].ticks_per_us = EMU_F_CPU / 1000000;
+    hd44780_reset(&lcd[c], emu_cycle);
+  }
+
+  emu_eeprom_open(eeprom_name);
+
+  return firmware_main();
+}
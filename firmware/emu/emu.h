@@ -0,0 +1,65 @@
+/* Name: emu.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * The firmware sources are compiled for the host against the fake AVR
+ * headers in this directory. All i/o register accesses go through
+ * emu_io() which keeps the emulated hardware (LCD controllers, keys,
+ * timers) in sync with the register contents and counts cpu cycles.
+ */
+
+#ifndef EMU_H
+#define EMU_H
+
+#include <stdint.h>
+
+#define EMU_F_CPU     12000000UL     /* emulated cpu clock */
+#define EMU_IO_SIZE   0x40           /* size of the avr i/o space */
+
+/* i/o register addresses of the ATmega8 */
+#define EMU_TWBR      0x00
+#define EMU_PIND      0x10
+#define EMU_DDRD      0x11
+#define EMU_PORTD     0x12
+#define EMU_PINC      0x13
+#define EMU_DDRC      0x14
+#define EMU_PORTC     0x15
+#define EMU_PINB      0x16
+#define EMU_DDRB      0x17
+#define EMU_PORTB     0x18
+#define EMU_OCR2      0x23
+#define EMU_TCNT2     0x24
+#define EMU_TCCR2     0x25
+#define EMU_OCR1B     0x28
+#define EMU_OCR1A     0x2a
+#define EMU_TCNT1     0x2c
+#define EMU_TCCR1B    0x2e
+#define EMU_TCCR1A    0x2f
+#define EMU_TCNT0     0x32
+#define EMU_TCCR0     0x33
+#define EMU_TIFR      0x38
+#define EMU_TIMSK     0x39
+
+/* cpu cycles spent since reset */
+extern uint64_t emu_cycle;
+
+/* state of the two push buttons S1 and S2, bit set = pressed */
+extern uint8_t emu_keys;
+
+/* access an i/o register, this syncs the emulated hardware first */
+extern volatile uint8_t *emu_io(uint8_t addr);
+extern volatile uint16_t *emu_io16(uint8_t addr);
+
+/* let the emulated cpu spend a number of cycles */
+extern void emu_cycles(uint32_t cycles);
+
+/* propagate register changes to the emulated hardware */
+extern void emu_sync(void);
+
+/* eeprom image */
+extern uint8_t emu_eeprom_read(uint16_t addr);
+extern void emu_eeprom_write(uint16_t addr, uint8_t value);
+extern int emu_eeprom_ready(void);
+
+#endif /* EMU_H */
@@ -0,0 +1,250 @@
+/* Name: hd44780.c
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ */
+
+#include <string.h>
+
+#include "hd44780.h"
+
+/* execution times in us for fosc = 270kHz, see HD44780U data sheet */
+/* table 6. RAM accesses take additional 4us (tADD) */
+static const struct {
+  const char *name;
+  uint32_t us;
+} hd44780_op[HD44780_OPS] = {
+  { "clear",    1520 },
+  { "home",     1520 },
+  { "entry",      37 },
+  { "display",    37 },
+  { "shift",      37 },
+  { "function",   37 },
+  { "cgram",      37 },
+  { "ddram",      37 },
+  { "write",      41 },
+  { "read",       41 }
+};
+
+/* the internal reset keeps the controller busy after power on */
+#define HD44780_POWER_ON_US  15000
+
+const char *hd44780_op_name(int op) {
+  return hd44780_op[op].name;
+}
+
+void hd44780_reset(struct hd44780 *lcd, uint64_t now) {
+  int present = lcd->present;
+  uint32_t ticks_per_us = lcd->ticks_per_us;
+
+  memset(lcd, 0, sizeof(*lcd));
+  memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+
+  lcd->present = present;
+  lcd->ticks_per_us = ticks_per_us?ticks_per_us:1;
+  lcd->bus8 = 1;
+  lcd->lines = 1;
+  lcd->inc = 1;
+
+  lcd->busy_until = now + (uint64_t)HD44780_POWER_ON_US * lcd->ticks_per_us;
+  lcd->op = HD44780_OP_FUNCTION;
+}
+
+int hd44780_busy(struct hd44780 *lcd, uint64_t now) {
+  return now < lcd->busy_until;
+}
+
+/* start executing an operation */
+static void hd44780_start(struct hd44780 *lcd, int op, uint64_t now) {
+  lcd->stat[op].count++;
+  lcd->op = op;
+  lcd->busy_until = now + (uint64_t)hd44780_op[op].us * lcd->ticks_per_us;
+  lcd->waiting = 0;
+}
+
+/* advance the address counter after a ddram/cgram access. In two line */
+/* mode ddram is split into 0x00..0x27 and 0x40..0x67 */
+static void hd44780_step(struct hd44780 *lcd, int inc) {
+  if(lcd->cg) {
+    lcd->ac = (lcd->ac + (inc?1:-1)) & (HD44780_CGRAM_SIZE-1);
+    return;
+  }
+
+  if(lcd->lines == 2) {
+    if(inc) {
+      if(lcd->ac == 0x27)      lcd->ac = 0x40;
+      else if(lcd->ac == 0x67) lcd->ac = 0x00;
+      else                     lcd->ac++;
+    } else {
+      if(lcd->ac == 0x40)      lcd->ac = 0x27;
+      else if(lcd->ac == 0x00) lcd->ac = 0x67;
+      else                     lcd->ac--;
+    }
+  } else
+    lcd->ac = (lcd->ac + (inc?1:-1) + 80) % 80;
+}
+
+/* shift the whole display by one position */
+static void hd44780_shift(struct hd44780 *lcd, int right) {
+  lcd->shift = (lcd->shift + (right?HD44780_LINE_SIZE-1:1)) % 
+    HD44780_LINE_SIZE;
+}
+
+static void hd44780_instruction(struct hd44780 *lcd, uint8_t cmd, 
+				uint64_t now) {
+  if(cmd & 0x80) {                    /* set ddram address */
+    hd44780_start(lcd, HD44780_OP_DDRAM, now);
+    lcd->ac = cmd & 0x7f;
+    lcd->cg = 0;
+  } else if(cmd & 0x40) {             /* set cgram address */
+    hd44780_start(lcd, HD44780_OP_CGRAM, now);
+    lcd->ac = cmd & 0x3f;
+    lcd->cg = 1;
+  } else if(cmd & 0x20) {             /* function set */
+    hd44780_start(lcd, HD44780_OP_FUNCTION, now);
+    lcd->bus8 = (cmd & 0x10)?1:0;
+    lcd->lines = (cmd & 0x08)?2:1;
+  } else if(cmd & 0x10) {             /* cursor/display shift */
+    hd44780_start(lcd, HD44780_OP_SHIFT, now);
+    if(cmd & 0x08)
+      hd44780_shift(lcd, cmd & 0x04);
+    else
+      hd44780_step(lcd, cmd & 0x04);
+  } else if(cmd & 0x08) {             /* display on/off control */
+    hd44780_start(lcd, HD44780_OP_DISPLAY, now);
+    lcd->display = (cmd & 0x04)?1:0;
+    lcd->cursor = (cmd & 0x02)?1:0;
+    lcd->blink = (cmd & 0x01)?1:0;
+  } else if(cmd & 0x04) {             /* entry mode set */
+    hd44780_start(lcd, HD44780_OP_ENTRY, now);
+    lcd->inc = (cmd & 0x02)?1:0;
+    lcd->entry_shift = (cmd & 0x01)?1:0;
+  } else if(cmd & 0x02) {             /* return home */
+    hd44780_start(lcd, HD44780_OP_HOME, now);
+    lcd->ac = 0;
+    lcd->cg = 0;
+    lcd->shift = 0;
+  } else if(cmd & 0x01) {             /* clear display */
+    hd44780_start(lcd, HD44780_OP_CLEAR, now);
+    memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+    lcd->ac = 0;
+    lcd->cg = 0;
+    lcd->inc = 1;
+    lcd->shift = 0;
+  }
+}
+
+static void hd44780_write(struct hd44780 *lcd, int rs, uint8_t val, 
+			  uint64_t now) {
+
+  /* the controller ignores everything while busy */
+  if(hd44780_busy(lcd, now)) {
+    lcd->stat[rs?HD44780_OP_WRITE:lcd->op].lost++;
+    return;
+  }
+
+  if(!rs) {
+    hd44780_instruction(lcd, val, now);
+    return;
+  }
+
+  hd44780_start(lcd, HD44780_OP_WRITE, now);
+
+  if(lcd->cg) lcd->cgram[lcd->ac & (HD44780_CGRAM_SIZE-1)] = val;
+  else        lcd->ddram[lcd->ac & (HD44780_DDRAM_SIZE-1)] = val;
+
+  hd44780_step(lcd, lcd->inc);
+
+  if(lcd->entry_shift && !lcd->cg)
+    hd44780_shift(lcd, !lcd->inc);
+}
+
+void hd44780_write_nibble(struct hd44780 *lcd, int rs, uint8_t nibble,
+			  uint64_t now) {
+  if(!lcd->present)
+    return;
+
+  nibble &= 0x0f;
+
+  /* a read in between restarts with the high nibble */
+  if(lcd->reading) {
+    lcd->reading = 0;
+    lcd->nibble = 0;
+  }
+
+  /* in 8 bit mode DB3..DB0 are not connected and the internal */
+  /* pullups make them read as 1 */
+  if(lcd->bus8) {
+    hd44780_write(lcd, rs, (nibble << 4) | 0x0f, now);
+    lcd->nibble = 0;
+    return;
+  }
+
+  if(!lcd->nibble) {
+    lcd->latch = nibble << 4;
+    lcd->nibble = 1;
+    return;
+  }
+
+  lcd->nibble = 0;
+  hd44780_write(lcd, rs, lcd->latch | nibble, now);
+}
+
+uint8_t hd44780_read_nibble(struct hd44780 *lcd, int rs, uint64_t now) {
+  uint8_t val;
+
+  if(!lcd->present)
+    return 0x0f;
+
+  /* a write in between restarts with the high nibble */
+  if(!lcd->reading) {
+    lcd->reading = 1;
+    lcd->rd_nibble = 0;
+  }
+
+  /* the whole byte is latched with the high nibble */
+  if(!lcd->rd_nibble) {
+    if(rs) {
+      if(hd44780_busy(lcd, now))
+	lcd->stat[HD44780_OP_READ].lost++;
+      else {
+	lcd->rd_latch = lcd->cg?lcd->cgram[lcd->ac & (HD44780_CGRAM_SIZE-1)]:
+	  lcd->ddram[lcd->ac & (HD44780_DDRAM_SIZE-1)];
+	hd44780_start(lcd, HD44780_OP_READ, now);
+	hd44780_step(lcd, lcd->inc);
+      }
+    } else {
+      lcd->rd_latch = lcd->ac & 0x7f;
+
+      if(hd44780_busy(lcd, now)) {
+	lcd->rd_latch |= 0x80;
+	lcd->stat[lcd->op].polls++;
+
+	if(!lcd->waiting) {
+	  lcd->waiting = 1;
+	  lcd->polled = now;
+	}
+      } else if(lcd->waiting) {
+	/* the reader has been waiting since the first busy read */
+	lcd->stat[lcd->op].wait += now - lcd->polled;
+	lcd->waiting = 0;
+      }
+    }
+
+    val = lcd->rd_latch >> 4;
+    lcd->rd_nibble = !lcd->bus8;
+  } else {
+    val = lcd->rd_latch & 0x0f;
+    lcd->rd_nibble = 0;
+  }
+
+  return val;
+}
+
+uint8_t hd44780_visible(struct hd44780 *lcd, int line, int col) {
+  if(lcd->lines == 2)
+    return lcd->ddram[(line & 1) * 0x40 + 
+		      (col + lcd->shift) % HD44780_LINE_SIZE];
+
+  return lcd->ddram[(col + lcd->shift) % 80];
+}
@@ -0,0 +1,100 @@
+/* Name: hd44780.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * Model of a HD44780 lcd controller attached through its 4 bit
+ * interface. The model sees the nibbles clocked in and out by the E line
+ * and executes the resulting instructions. It keeps DDRAM, CGRAM, the
+ * address counter, entry mode and display shift and models the
+ * execution time of every instruction: the busy flag is set while an
+ * instruction executes and the busy flag reads and ignored writes
+ * during that time are counted per instruction type.
+ *
+ * Time is passed in by the caller in arbitrary ticks (e.g. cpu cycles),
+ * ticks_per_us sets their relation to real time.
+ */
+
+#ifndef HD44780_H
+#define HD44780_H
+
+#include <stdint.h>
+
+#define HD44780_DDRAM_SIZE   0x80
+#define HD44780_CGRAM_SIZE   0x40
+#define HD44780_LINE_SIZE    40      /* ddram per line in two line mode */
+
+/* the operation types statistics are kept for */
+enum {
+  HD44780_OP_CLEAR = 0,
+  HD44780_OP_HOME,
+  HD44780_OP_ENTRY,
+  HD44780_OP_DISPLAY,
+  HD44780_OP_SHIFT,
+  HD44780_OP_FUNCTION,
+  HD44780_OP_CGRAM,
+  HD44780_OP_DDRAM,
+  HD44780_OP_WRITE,
+  HD44780_OP_READ,
+  HD44780_OPS
+};
+
+struct hd44780_stat {
+  unsigned long count;            /* operations executed */
+  unsigned long polls;            /* busy flag reads that returned busy */
+  unsigned long lost;             /* writes ignored since still busy */
+  uint64_t      wait;             /* ticks spent polling the busy flag */
+};
+
+struct hd44780 {
+  int      present;               /* controller is connected */
+  uint32_t ticks_per_us;
+  int      bus8;                  /* interface still in 8 bit mode */
+  int      lines;                 /* number of display lines, 1 or 2 */
+
+  int      nibble;                /* next nibble is the low one */
+  uint8_t  latch;                 /* high nibble received */
+  int      reading;               /* last access was a read */
+  int      rd_nibble;             /* next nibble read is the low one */
+  uint8_t  rd_latch;              /* byte being read */
+
+  uint8_t  ddram[HD44780_DDRAM_SIZE];
+  uint8_t  cgram[HD44780_CGRAM_SIZE];
+  uint8_t  ac;                    /* address counter */
+  int      cg;                    /* address counter points into cgram */
+  int      inc;                   /* entry mode: increment address */
+  int      entry_shift;           /* entry mode: shift display on write */
+  int      shift;                 /* display shift, 0..39 */
+  int      display, cursor, blink;
+
+  /* timing */
+  uint64_t busy_until;            /* end of current instruction */
+  uint64_t polled;                /* first busy flag read while busy */
+  int      op;                    /* type of current instruction */
+  int      waiting;               /* busy flag has been read as busy */
+
+  struct hd44780_stat stat[HD44780_OPS];
+};
+
+/* power on reset at time now */
+extern void hd44780_reset(struct hd44780 *lcd, uint64_t now);
+
+/* E falling edge with RW low: a nibble is written */
+extern void hd44780_write_nibble(struct hd44780 *lcd, int rs, 
+				 uint8_t nibble, uint64_t now);
+
+/* E rising edge with RW high: returns the nibble to put on DB7..DB4 */
+extern uint8_t hd44780_read_nibble(struct hd44780 *lcd, int rs, 
+				   uint64_t now);
+
+/* controller is executing an instruction */
+extern int hd44780_busy(struct hd44780 *lcd, uint64_t now);
+
+/* character shown at a position of a display line, honours the */
+/* display shift */
+extern uint8_t hd44780_visible(struct hd44780 *lcd, int line, int col);
+
+/* name of an operation type */
+extern const char *hd44780_op_name(int op);
+
+#endif /* HD44780_H */
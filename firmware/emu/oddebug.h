@@ -0,0 +1,13 @@
+/* Name: oddebug.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * License: GPL
+ */
+
+#ifndef EMU_ODDEBUG_H
+#define EMU_ODDEBUG_H
+
+#define odDebugInit()
+#define DBG1(code, data, len)
+#define DBG2(code, data, len)
+
+#endif /* EMU_ODDEBUG_H */
@@ -0,0 +1,242 @@
+/* Name: session.c
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * Plays a scripted session through liblcd2usb against the emulator.
+ * The emulator prints the display contents when the session ends,
+ * "make check" compares them with the expected dumps in sessions/.
+ *
+ * Each line of a script holds one command, arguments are separated by
+ * blanks and may be quoted. A command fails the session if the
+ * library reports an error, unless it's prefixed by '-':
+ *
+ *   clear                         fill the frame buffer with blanks
+ *   print row col text            draw text into the frame buffer
+ *   glyph row col b0 .. b7        draw a user defined glyph
+ *   commit                        send the frame buffer changes
+ *   marquee row text              start or stop a marquee
+ *   step [n]                      move the marquees n times
+ *   render / flip                 render into / flip the hidden page
+ *   ticker row col width ms text  start or stop the device ticker
+ *   store slot item ..            store a macro, 0xNN items are
+ *                                 commands, others are written as data
+ *   play ctrl slot                play a macro
+ *   command ctrl cmd              write a single command
+ *   write text                    write text at the cursor
+ *
+ * ctrl is 0, 1 or both. A session also fails if the device had to drop
+ * commands or data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lcd2usb.h"
+
+#define MAX_ARGS   16
+#define MAX_SEQ    125
+
+/* split line into blank separated and optionally quoted words */
+static int split(char *line, char **argv) {
+  int argc = 0;
+
+  for(;;) {
+    while(*line == ' ' || *line == '\t' || *line == '\n' || *line == '\r')
+      line++;
+
+    if(!*line || *line == '#' || argc == MAX_ARGS)
+      return argc;
+
+    if(*line == '"') {
+      argv[argc++] = ++line;
+      while(*line && *line != '"')
+	line++;
+    } else {
+      argv[argc++] = line;
+      while(*line && *line != ' ' && *line != '\t' &&
+	    *line != '\n' && *line != '\r')
+	line++;
+    }
+
+    if(*line)
+      *line++ = 0;
+  }
+}
+
+/* controller argument */
+static int ctrl(const char *arg) {
+  if(!strcmp(arg, "both"))
+    return LCD2USB_BOTH;
+
+  return atoi(arg)?LCD2USB_CTRL_1:LCD2USB_CTRL_0;
+}
+
+/* store a macro from a list of commands and strings */
+static int store(lcd2usb_t *lcd, int slot, int argc, char **argv) {
+  int seq[MAX_SEQ], len = 0, i;
+  char *p;
+
+  for(i=0;i<argc;i++) {
+    if(!strncmp(argv[i], "0x", 2)) {
+      if(len == MAX_SEQ) return -1;
+      seq[len++] = strtol(argv[i], NULL, 16);
+    } else {
+      for(p=argv[i];*p;p++) {
+	if(len == MAX_SEQ) return -1;
+	seq[len++] = LCD2USB_MACRO_DATA | (unsigned char)*p;
+      }
+    }
+  }
+
+  return lcd2usb_macro_store(lcd, slot, seq, len);
+}
+
+/* run a single command, returns -1 on failure */
+static int run(lcd2usb_t *lcd, int argc, char **argv) {
+  unsigned char glyph[8];
+  int i, n;
+
+  if(!strcmp(argv[0], "clear") && argc == 1) {
+    lcd2usb_fb_clear(lcd);
+    return 0;
+  }
+
+  if(!strcmp(argv[0], "print") && argc == 4) {
+    lcd2usb_fb_print(lcd, atoi(argv[1]), atoi(argv[2]), argv[3]);
+    return 0;
+  }
+
+  if(!strcmp(argv[0], "glyph") && argc == 11) {
+    for(i=0;i<8;i++)
+      glyph[i] = strtol(argv[3+i], NULL, 16);
+    return lcd2usb_fb_glyph(lcd, atoi(argv[1]), atoi(argv[2]), glyph);
+  }
+
+  if(!strcmp(argv[0], "commit") && argc == 1)
+    return lcd2usb_fb_commit(lcd);
+
+  if(!strcmp(argv[0], "marquee") && argc == 3)
+    return lcd2usb_marquee(lcd, atoi(argv[1]), argv[2]);
+
+  if(!strcmp(argv[0], "step") && argc <= 2) {
+    n = (argc == 2)?atoi(argv[1]):1;
+    while(n--)
+      if(lcd2usb_marquee_step(lcd) < 0)
+	return -1;
+    return 0;
+  }
+
+  if(!strcmp(argv[0], "render") && argc == 1)
+    return lcd2usb_page_render(lcd);
+
+  if(!strcmp(argv[0], "flip") && argc == 1)
+    return lcd2usb_page_flip(lcd);
+
+  if(!strcmp(argv[0], "ticker") && argc == 6)
+    return lcd2usb_ticker(lcd, atoi(argv[1]), atoi(argv[2]),
+			  atoi(argv[3]), argv[5], atoi(argv[4]));
+
+  if(!strcmp(argv[0], "store") && argc >= 2)
+    return store(lcd, atoi(argv[1]), argc-2, argv+2);
+
+  if(!strcmp(argv[0], "play") && argc == 3)
+    return lcd2usb_macro_play(lcd, ctrl(argv[1]), atoi(argv[2]));
+
+  if(!strcmp(argv[0], "command") && argc == 3)
+    return lcd2usb_command(lcd, ctrl(argv[1]), strtol(argv[2], NULL, 16));
+
+  if(!strcmp(argv[0], "write") && argc == 2)
+    return lcd2usb_write(lcd, argv[1]);
+
+  fprintf(stderr, "unknown command or wrong arguments\n");
+  return -1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-c controllers] [-s COLSxROWS] [-n] script\n",
+	  name);
+  fprintf(stderr, "  -c n        number of lcd controllers (1 or 2)\n");
+  fprintf(stderr, "  -s 20x4     display size\n");
+  fprintf(stderr, "  -n          send short requests only\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int c, ctrls = 1, rows = 2, cols = 16, nolong = 0, line = 0, ret = 0;
+  char cmd[256], buf[256], *args[MAX_ARGS], *name;
+  lcd2usb_t *lcd;
+  FILE *file;
+
+  while((c = getopt(argc, argv, "c:s:n")) != -1) {
+    switch(c) {
+    case 'c':
+      ctrls = atoi(optarg);
+      break;
+    case 's':
+      if(sscanf(optarg, "%dx%d", &cols, &rows) != 2)
+	usage(argv[0]);
+      break;
+    case 'n':
+      nolong = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if(optind != argc-1 || ctrls < 1 || ctrls > 2)
+    usage(argv[0]);
+
+  if(!(file = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  /* the emulator lives next to this program */
+  name = strrchr(argv[0], '/');
+  snprintf(cmd, sizeof(cmd), "%.*slcd2usb-emu -c %d -s %dx%d",
+	   name?(int)(name-argv[0]+1):0, argv[0], ctrls, cols, rows);
+
+  if(!(lcd = lcd2usb_open_emu(cmd, 0))) {
+    fprintf(stderr, "unable to start \"%s\"\n", cmd);
+    return 1;
+  }
+
+  if(nolong)
+    lcd2usb_set_long(lcd, 0);
+
+  if(lcd2usb_fb_init(lcd, (ctrls == 2)?3:1, rows, cols) < 0) {
+    fprintf(stderr, "%s: display size not supported\n", argv[optind]);
+    ret = 1;
+  }
+
+  while(!ret && fgets(buf, sizeof(buf), file)) {
+    line++;
+    if(!(c = split(buf, args)))
+      continue;
+
+    /* a leading '-' ignores errors */
+    if(args[0][0] == '-') {
+      args[0]++;
+      run(lcd, c, args);
+    } else if(run(lcd, c, args) < 0) {
+      fprintf(stderr, "%s:%d: %s failed\n", argv[optind], line, args[0]);
+      ret = 1;
+    }
+  }
+
+  fclose(file);
+
+  /* nothing sent may have been dropped by the device */
+  if(!ret && (lcd2usb_get_queue(lcd, &c) < 0 || c)) {
+    fprintf(stderr, "%s: device queue overflowed\n", argv[optind]);
+    ret = 1;
+  }
+
+  /* the emulator prints the display once the connection is closed */
+  lcd2usb_close(lcd);
+  return ret;
+}
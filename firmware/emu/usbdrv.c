@@ -0,0 +1,287 @@
+/* Name: usbdrv.c
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * AVR-USB driver replacement, see usbdrv.h for the wire protocol
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#include "emu.h"
+#include "usbdrv.h"
+
+extern void emu_exit(void);
+
+int emu_usb_fd = 0;                 /* connection to the host */
+unsigned long emu_usb_setups = 0;   /* setup requests processed */
+uint64_t emu_usb_ready = 0;         /* cycle of the first usbPoll() */
+uint64_t emu_usb_cycles = 0;        /* cycles spent in usb callbacks */
+uint64_t emu_usb_max = 0;           /* longest callback into the firmware */
+unsigned long emu_usb_naks = 0;     /* polls refused by flow control */
+unsigned long emu_usb_refused = 0;  /* setup packets refused likewise */
+int emu_usb_realtime = 0;           /* don't answer ahead of real time */
+
+static struct timeval usb_start;    /* real time at usbInit() */
+static uint64_t usb_closed = 0;     /* cycle the host disconnected at */
+
+uchar *usbMsgPtr;
+
+/* after this many polls without a request the emulator sleeps */
+/* instead of spinning, the cpu time passed meanwhile is added */
+#define IDLE_POLLS   1000
+
+/* cycles spent by a main loop iteration without a usb request */
+#define POLL_CYCLES  32
+
+void usbInit(void) {
+  gettimeofday(&usb_start, NULL);
+}
+
+/* read exactly len bytes, the host closing the connection ends */
+/* the emulation */
+static void usb_read(void *buf, int len) {
+  uchar *p = buf;
+  ssize_t n;
+
+  while(len) {
+    if((n = read(emu_usb_fd, p, len)) <= 0)
+      emu_exit();
+
+    p += n;
+    len -= n;
+  }
+}
+
+static void usb_reply(uchar status, uchar *data, unsigned len) {
+  uchar hdr[3] = { status, len & 0xff, len >> 8 };
+
+  /* the emulated cpu usually runs faster than the real one. In real */
+  /* time mode the reply is delayed until the real time has caught up, */
+  /* so the host sees the throughput of the real device */
+  if(emu_usb_realtime) {
+    struct timeval now;
+    int64_t us;
+
+    gettimeofday(&now, NULL);
+    us = emu_cycle / (EMU_F_CPU / 1000000) - 
+      ((now.tv_sec - usb_start.tv_sec) * 1000000LL + 
+       now.tv_usec - usb_start.tv_usec);
+    if(us > 0)
+      usleep(us);
+  }
+
+  if((write(emu_usb_fd, hdr, sizeof(hdr)) != sizeof(hdr)) ||
+     (len && (write(emu_usb_fd, data, len) != len))) {
+    perror("emu: usb write");
+    exit(1);
+  }
+}
+
+/* state of the data stage of a control-out transfer, it's fed to */
+/* usbFunctionWrite() in 8 byte packets, one packet per usbPoll() */
+/* just like the real driver does */
+static unsigned out_left = 0;       /* data stage bytes not yet received */
+static int out_active = 0;          /* a data stage is in progress */
+static uchar out_status;            /* transfer has been stalled */
+static usbMsgLen_t out_len;         /* reply len of usbFunctionSetup() */
+
+#if USB_CFG_HAVE_FLOWCONTROL
+volatile schar usbRxLen = 0;
+#endif
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+uchar emu_usb_intr_len = 0xff;
+static uchar intr_buf[8];
+
+void usbSetInterrupt(uchar *data, uchar len) {
+  if(len > sizeof(intr_buf))
+    len = sizeof(intr_buf);
+
+  memcpy(intr_buf, data, len);
+  emu_usb_intr_len = len;
+}
+#endif
+
+/* requests addressed to the emulator itself, see usbdrv.h */
+static void usb_emu_request(uchar *data) {
+  if(data[0] == 0xfe) {
+    emu_keys = data[2];
+    usb_reply(0, NULL, 0);
+    return;
+  }
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+  if(emu_usb_intr_len != 0xff) {
+    usb_reply(0, intr_buf, emu_usb_intr_len);
+    emu_usb_intr_len = 0xff;
+    return;
+  }
+#endif
+
+  usb_reply(2, NULL, 0);
+}
+
+static void usb_out_packet(void) {
+  uchar buf[8], chunk = (out_left > 8)?8:out_left;
+
+  if(chunk) {
+    usb_read(buf, chunk);
+    out_left -= chunk;
+  }
+
+#if USB_CFG_IMPLEMENT_FN_WRITE
+  if((out_len == USB_NO_MSG) && !out_status && chunk) {
+    uint64_t start = emu_cycle;
+    uchar rval = usbFunctionWrite(buf, chunk);
+    emu_usb_cycles += emu_cycle - start;
+
+    if(emu_cycle - start > emu_usb_max)
+      emu_usb_max = emu_cycle - start;
+
+    if(rval == 0xff)
+      out_status = 1;
+    else if(rval)
+      out_len = 0;
+  }
+#endif
+
+  if(!out_left) {
+    out_active = 0;
+    usb_reply(out_status, NULL, 0);
+  }
+}
+
+static void usb_setup(void) {
+  uchar data[8], buf[256], *reply = NULL;
+  usbRequest_t *rq = (usbRequest_t*)data;
+  unsigned wLength, len = 0;
+  usbMsgLen_t replyLen;
+  uint64_t start;
+
+  /* the host closing the connection between two transfers ends */
+  /* the emulation once the firmware had time to finish its work */
+  if(read(emu_usb_fd, data, 1) <= 0) {
+    usb_closed = emu_cycle;
+    return;
+  }
+
+  usb_read(data+1, sizeof(data)-1);
+  wLength = data[6] | (data[7] << 8);
+  rq->wValue.word = data[2] | (data[3] << 8);
+  rq->wIndex.word = data[4] | (data[5] << 8);
+  rq->wLength.word = wLength;
+
+  if(data[0] >= 0xfe) {
+    usb_emu_request(data);
+    return;
+  }
+
+#if USB_CFG_HAVE_FLOWCONTROL
+  /* the real driver would nak the setup packet as well, which a host */
+  /* treats as an error. Flow control may only hold off the data */
+  /* stage of a transfer in progress, so the request fails here */
+  if(usbRxLen < 0) {
+    fprintf(stderr, "emu: setup packet refused by flow control\n");
+    emu_usb_refused++;
+    if(!(data[0] & 0x80) && wLength)
+      usb_read(buf, (wLength > sizeof(buf))?sizeof(buf):wLength);
+    usb_reply(1, NULL, 0);
+    return;
+  }
+#endif
+
+  emu_usb_setups++;
+
+  /* only vendor requests are passed to the firmware */
+  if((data[0] & 0x60) != 0x40) {
+    if(!(data[0] & 0x80) && wLength)
+      usb_read(buf, (wLength > sizeof(buf))?sizeof(buf):wLength);
+    usb_reply(0, NULL, 0);
+    return;
+  }
+
+  start = emu_cycle;
+  replyLen = usbFunctionSetup(data);
+  emu_usb_cycles += emu_cycle - start;
+
+  /* the usb host waits this long for the request to be acknowledged */
+  if(emu_cycle - start > emu_usb_max)
+    emu_usb_max = emu_cycle - start;
+
+  if(!(data[0] & 0x80)) {
+    /* control-out: the data stage follows with the next polls */
+    out_left = wLength;
+    out_len = replyLen;
+    out_status = 0;
+    out_active = 1;
+    if(!out_left)
+      usb_out_packet();
+    return;
+  }
+
+  /* control-in */
+  if(replyLen != USB_NO_MSG) {
+    len = (replyLen > wLength)?wLength:replyLen;
+    reply = usbMsgPtr;
+  }
+
+  usb_reply(0, reply, len);
+}
+
+void usbPoll(void) {
+  static int idle = 0;
+  struct pollfd pfd = { emu_usb_fd, POLLIN, 0 };
+  struct timeval start, end;
+  int timeout = 0;
+
+  emu_sync();
+  if(!emu_usb_ready)
+    emu_usb_ready = emu_cycle;
+  emu_cycle += POLL_CYCLES;
+
+  if(usb_closed) {
+    if(emu_cycle - usb_closed > EMU_F_CPU / 5)
+      emu_exit();
+
+    return;
+  }
+
+#if USB_CFG_HAVE_FLOWCONTROL
+  /* the host keeps retrying while the firmware refuses data */
+  if(out_active && (usbRxLen < 0)) {
+    emu_usb_naks++;
+    return;
+  }
+#endif
+
+  /* nothing happened for a while: let the host process sleep */
+  if(idle >= IDLE_POLLS)
+    timeout = 1;
+
+  gettimeofday(&start, NULL);
+
+  if(poll(&pfd, 1, timeout) <= 0) {
+    if(timeout) {
+      /* the emulated cpu kept running meanwhile */
+      gettimeofday(&end, NULL);
+      emu_cycle += ((end.tv_sec - start.tv_sec) * 1000000ULL + 
+		    end.tv_usec - start.tv_usec) * (EMU_F_CPU / 1000000);
+    }
+
+    idle++;
+    return;
+  }
+
+  idle = 0;
+
+  if(out_active)
+    usb_out_packet();
+  else
+    usb_setup();
+}
@@ -0,0 +1,89 @@
+/* Name: usbdrv.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * Tabsize: 4
+ * License: GPL
+ *
+ * Replacement for the AVR-USB driver interface. Instead of bit banging
+ * the usb lines the emulator receives setup packets (and data stages)
+ * from a socket and feeds them into usbFunctionSetup() and
+ * usbFunctionWrite() just like the real driver does.
+ *
+ * Wire protocol, host to emulator:
+ *   8 byte setup packet, followed by wLength data bytes for control-out
+ *   transfers
+ * Emulator to host:
+ *   1 byte status (0 = ack, 1 = stall, 2 = nak), 2 byte length (little
+ *   endian), followed by the data of control-in transfers
+ *
+ * Two request types which can't occur on a real bus are used to
+ * control the emulator itself:
+ *   bmRequestType 0xff: poll the interrupt-in endpoint, answered with
+ *                       the data passed to usbSetInterrupt() or a nak
+ *   bmRequestType 0xfe: set the state of the keys to wValue
+ */
+
+#ifndef EMU_USBDRV_H
+#define EMU_USBDRV_H
+
+#include <stdint.h>
+#include "usbconfig.h"
+
+#ifndef uchar
+#define uchar   unsigned char
+#endif
+#ifndef schar
+#define schar   signed char
+#endif
+
+#ifndef USB_CFG_LONG_TRANSFERS
+#define USB_CFG_LONG_TRANSFERS  0
+#endif
+
+#if USB_CFG_LONG_TRANSFERS
+#   define usbMsgLen_t unsigned
+#else
+#   define usbMsgLen_t uchar
+#endif
+#define USB_NO_MSG  ((usbMsgLen_t)-1)
+
+#define USBMASK     ((1<<USB_CFG_DPLUS_BIT) | (1<<USB_CFG_DMINUS_BIT))
+
+typedef union usbWord {
+    uint16_t    word;
+    uchar       bytes[2];
+} usbWord_t;
+
+typedef struct usbRequest {
+    uchar       bmRequestType;
+    uchar       bRequest;
+    usbWord_t   wValue;
+    usbWord_t   wIndex;
+    usbWord_t   wLength;
+} usbRequest_t;
+
+extern uchar *usbMsgPtr;
+
+extern void usbInit(void);
+extern void usbPoll(void);
+
+extern usbMsgLen_t usbFunctionSetup(uchar data[8]);
+#if USB_CFG_IMPLEMENT_FN_WRITE
+extern uchar usbFunctionWrite(uchar *data, uchar len);
+#endif
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+extern uchar emu_usb_intr_len;  /* bytes waiting to be polled, 0xff = none */
+extern void usbSetInterrupt(uchar *data, uchar len);
+#define usbInterruptIsReady()   (emu_usb_intr_len == 0xff)
+#endif
+
+#if USB_CFG_HAVE_FLOWCONTROL
+/* while disabled the emulator doesn't deliver further data packets, */
+/* the real driver NAKs them */
+extern volatile schar usbRxLen;
+#define usbDisableAllRequests()     usbRxLen = -1
+#define usbEnableAllRequests()      usbRxLen = 0
+#define usbAllRequestsAreDisabled() (usbRxLen < 0)
+#endif
+
+#endif /* EMU_USBDRV_H */
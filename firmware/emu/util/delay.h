@@ -0,0 +1,14 @@
+/* Name: util/delay.h
+ * Project: LCD2USB; host compiled firmware emulator
+ * License: GPL
+ */
+
+#ifndef EMU_UTIL_DELAY_H
+#define EMU_UTIL_DELAY_H
+
+#include "emu.h"
+
+/* 16 bit counter, 4 cycles per loop */
+#define _delay_loop_2(n)    emu_cycles(4UL * (n))
+
+#endif /* EMU_UTIL_DELAY_H */
@@ -36,7 +36,11 @@
 #define DDR(x) (*(&x - 1))  /* address of data direction register of port x */
 #define PIN(x) (*(&x - 2))  /* address of input register of port x          */
 
+#ifdef __AVR__
 #define lcd_e_delay()   __asm__ __volatile__( "rjmp 1f\n 1:" );
+#else
+#define lcd_e_delay()   emu_cycles(2);  /* host build, see emu/ */
+#endif
 #define lcd_e0_high()   LCD_E_PORT  |=  _BV(LCD_E0_PIN);
 #define lcd_e0_low()    LCD_E_PORT  &= ~_BV(LCD_E0_PIN);
 #define lcd_e1_high()   LCD_E_PORT  |=  _BV(LCD_E1_PIN);
@@ -65,6 +69,9 @@ static void lcd_e_toggle(uint8_t ctrl);
 *************************************************************************/
 static inline void _delayFourCycles(unsigned int __count)
 {
+#ifndef __AVR__
+    emu_cycles(__count?4*__count:2);
+#else
     if ( __count == 0 )    
         __asm__ __volatile__( "rjmp 1f\n 1:" );    // 2 cycles
     else
@@ -74,6 +81,7 @@ static inline void _delayFourCycles(unsigned int __count)
     	    : "=w" (__count)
     	    : "0" (__count)
     	   );
+#endif
 }
 
 
@@ -129,70 +137,151 @@ static void lcd_write(uint8_t ctrl, uint8_t data, uint8_t rs)
     LCD_DATA_PORT = dataBits | 0xF0;
 }
 
+static uint8_t lcd_bus_read = 1;    /* data pins may be set to input */
+
 /*************************************************************************
-Low-level function to read byte from LCD controller
-Input:    rs     1: read data    
-                 0: read busy flag / address counter
-Returns:  byte read from LCD controller
+Read the busy flags of the given controllers in one interleaved read
+sequence. Only the high nibble carrying the busy flag is sampled, the
+low nibble is clocked out without being read. With two controllers the
+enable pulse of one keeps the other's enable low long enough
+Input:    bitmap of controllers
+Returns:  bitmap of busy controllers
 *************************************************************************/
-static uint8_t lcd_read(uint8_t ctrl, uint8_t rs) 
+static uint8_t lcd_read_busy(uint8_t ctrl)
 {
-    uint8_t data;
-    
-    if (rs) lcd_rs_high();                   /* RS=1: read data      */
-    else    lcd_rs_low();                    /* RS=0: read busy flag */
+    uint8_t busy = 0;
+
+    lcd_bus_read = 1;
+    lcd_rs_low();                            /* RS=0: read busy flag */
     lcd_rw_high();                           /* RW=1  read mode      */
-    
+
     DDR(LCD_DATA_PORT) &= 0x0F;         /* configure data pins as input */
     LCD_DATA_PORT |= 0xF0;              /* enable pullups to get a busy */
                                         /* on unconnected display       */
 
-    if(ctrl & LCD_CTRL_0) lcd_e0_high();
-    if(ctrl & LCD_CTRL_1) lcd_e1_high();
-    lcd_e_delay();        
-    data = PIN(LCD_DATA_PORT) & 0xF0;     /* read high nibble first */
-    if(ctrl & LCD_CTRL_0) lcd_e0_low();
-    if(ctrl & LCD_CTRL_1) lcd_e1_low();
+    /* high nibbles, the controllers must not drive the bus together */
+    if(ctrl & LCD_CTRL_0) {
+        lcd_e0_high();
+        lcd_e_delay();
+        if(PIN(LCD_DATA_PORT) & (1<<LCD_BUSY))
+            busy |= LCD_CTRL_0;
+        lcd_e0_low();
+    }
+
+    if(ctrl & LCD_CTRL_1) {
+        lcd_e1_high();
+        lcd_e_delay();
+        if(PIN(LCD_DATA_PORT) & (1<<LCD_BUSY))
+            busy |= LCD_CTRL_1;
+        lcd_e1_low();
+    }
+
+    if(ctrl != (LCD_CTRL_0 | LCD_CTRL_1))
+        lcd_e_delay();                    /* Enable 500ns low       */
+
+    /* low nibbles, not needed */
+    if(ctrl & LCD_CTRL_0) {
+        lcd_e0_high();
+        lcd_e_delay();
+        lcd_e0_low();
+    }
+
+    if(ctrl & LCD_CTRL_1) {
+        lcd_e1_high();
+        lcd_e_delay();
+        lcd_e1_low();
+    }
+
+    return busy;
+}
 
-    lcd_e_delay();                        /* Enable 500ns low       */
-    
-    if(ctrl & LCD_CTRL_0) lcd_e0_high();
-    if(ctrl & LCD_CTRL_1) lcd_e1_high();
-    lcd_e_delay();
-    data |= PIN(LCD_DATA_PORT) >> 4;      /* read low nibble        */
-    if(ctrl & LCD_CTRL_0) lcd_e0_low();
-    if(ctrl & LCD_CTRL_1) lcd_e1_low();
 
-    return data;
+/*
+** timed mode: instead of reading the busy flag the end of an instruction
+** is calculated from its execution time (HD44780U data sheet, table 6,
+** fosc = 270kHz). Timer 2 counts in steps of 32 cycles while timed mode
+** is on, it wraps after 256 steps (683us at 12MHz). Clear and home take
+** longer and are still followed by busy flag reads
+*/
+#define LCD_TICKS(us)   ((us) * (XTAL/1000) / 32000 + 2)  /* rounded up */
+#define LCD_EXEC_TICKS  LCD_TICKS(37)       /* most instructions */
+#define LCD_DATA_TICKS  LCD_TICKS(37+4)     /* ram accesses take tADD more */
+
+static uint8_t lcd_timed = 0;       /* timed mode is on */
+static uint8_t lcd_running = 0;     /* controllers with known end of busy */
+static uint8_t lcd_unknown = 0;     /* controllers that have to be polled */
+static uint8_t lcd_start[2];        /* timer 2 at start of instruction */
+static uint8_t lcd_ticks[2];        /* timer 2 steps the instruction takes */
+
+/* an instruction has been sent, ticks = 0 if its timing isn't known */
+static void lcd_started(uint8_t ctrl, uint8_t ticks)
+{
+    uint8_t now = TCNT2;
+
+    if(!lcd_timed)
+        return;
+
+    if(!ticks) {
+        lcd_running &= ~ctrl;
+        lcd_unknown |= ctrl;
+        return;
+    }
+
+    if(ctrl & LCD_CTRL_0) {
+        lcd_start[0] = now;
+        lcd_ticks[0] = ticks;
+    }
+    if(ctrl & LCD_CTRL_1) {
+        lcd_start[1] = now;
+        lcd_ticks[1] = ticks;
+    }
+
+    lcd_running |= ctrl;
+    lcd_unknown &= ~ctrl;
 }
 
+/*************************************************************************
+Check which of the given controllers are busy. In timed mode the busy
+flag is only read if the end of the last instruction isn't known. After
+more than 683us without a check a controller may be taken as busy for
+up to one more instruction time, but never as ready too early
+Input:    bitmap of controllers
+Returns:  bitmap of busy controllers
+*************************************************************************/
+static uint8_t lcd_check_busy(uint8_t ctrl)
+{
+    uint8_t busy = 0, c, bit;
+
+    if(lcd_timed) {
+        for(c=0;c<2;c++) {
+            bit = c?LCD_CTRL_1:LCD_CTRL_0;
+            if(ctrl & lcd_running & bit) {
+                if((uint8_t)(TCNT2 - lcd_start[c]) < lcd_ticks[c])
+                    busy |= bit;
+                else
+                    lcd_running &= ~bit;
+            }
+        }
+
+        ctrl &= lcd_unknown;
+    }
+
+    if(ctrl) {
+        c = lcd_read_busy(ctrl);
+        lcd_unknown &= ~(ctrl & ~c);
+        busy |= c;
+    }
+
+    return busy;
+}
 
 /*************************************************************************
-loops while lcd is busy, returns address counter
+loops while any of the given controllers is busy. Controllers that
+became ready aren't checked anymore
 *************************************************************************/
 static void lcd_waitbusy(uint8_t ctrl)
 {
-#if 1
-    uint8_t busy;
-
-    do {
-        busy = 0;
-
-        /* check all controllers separately */
-        if(ctrl & LCD_CTRL_0)
-            if((lcd_read(LCD_CTRL_0, 0)) & (1<<LCD_BUSY))
-	        busy = 1;
-
-        if(ctrl & LCD_CTRL_1)
-            if((lcd_read(LCD_CTRL_1, 0)) & (1<<LCD_BUSY))
-	        busy = 1;
-
-        /* wait until busy flag is cleared */
-    } while (busy);
-#else
-    /* check all controllers at once (ugly!!!) */
-   while ( (lcd_read(ctrl, 0)) & (1<<LCD_BUSY));
-#endif
+    while((ctrl = lcd_check_busy(ctrl)));
 }
 
 /*
@@ -208,6 +297,9 @@ void lcd_command(uint8_t ctrl, uint8_t cmd)
 {
     lcd_waitbusy(ctrl);
     lcd_write(ctrl, cmd, 0);
+
+    /* clear and home take up to 1.52ms */
+    lcd_started(ctrl, (cmd < (1<<LCD_ENTRY_MODE))?0:LCD_EXEC_TICKS);
 }
 
 
@@ -220,6 +312,73 @@ void lcd_data(uint8_t ctrl, uint8_t data)
 {
     lcd_waitbusy(ctrl);
     lcd_write(ctrl, data, 1);
+    lcd_started(ctrl, LCD_DATA_TICKS);
+}
+
+/*************************************************************************
+Write a run of data bytes to the given controllers. RS, RW and the data
+pins are set up once and only again after a busy flag read, which timed
+mode mostly avoids. The data pins are released at the end
+Input:    bitmap of controllers
+          bytes to write and their number
+Returns:  none
+*************************************************************************/
+void lcd_data_burst(uint8_t ctrl, const uint8_t *data, uint8_t len)
+{
+    uint8_t dataBits = 0;
+
+    if(!len)
+        return;
+
+    lcd_bus_read = 1;
+
+    while(len--) {
+        lcd_waitbusy(ctrl);
+
+        if(lcd_bus_read) {
+            lcd_rs_high();               /* write data (RS=1, RW=0) */
+            lcd_rw_low();
+            DDR(LCD_DATA_PORT) |= 0xF0;
+            dataBits = LCD_DATA_PORT & 0x0F;     /* includes RS */
+            lcd_bus_read = 0;
+        }
+
+        LCD_DATA_PORT = dataBits | (*data & 0xF0);
+        lcd_e_toggle(ctrl);
+        LCD_DATA_PORT = dataBits | (*data++ << 4);
+        lcd_e_toggle(ctrl);
+
+        lcd_started(ctrl, LCD_DATA_TICKS);
+    }
+
+    /* all data pins high (inactive) */
+    LCD_DATA_PORT = dataBits | 0xF0;
+}
+
+/*************************************************************************
+Check if any of the given controllers is busy without waiting
+Input:   bitmap of controllers
+Returns: 1 if busy, 0 else
+*************************************************************************/
+uint8_t lcd_busy(uint8_t ctrl)
+{
+    return lcd_check_busy(ctrl)?1:0;
+}
+
+/*************************************************************************
+Switch timed mode on or off. The controllers are polled once before
+their instructions are timed
+Input:   1: time instructions
+         0: read the busy flag before each write
+Returns: none
+*************************************************************************/
+void lcd_set_timed(uint8_t on)
+{
+    TCCR2 = on?(_BV(CS21) | _BV(CS20)):0;   /* prescaler 32 */
+
+    lcd_timed = on;
+    lcd_running = 0;
+    lcd_unknown = LCD_CTRL_0 | LCD_CTRL_1;
 }
 
 /*************************************************************************
@@ -238,17 +397,28 @@ Returns:  none
 void lcd_puts(uint8_t ctrl, const char *s)
 /* print string on lcd (no auto linefeed) */
 {
-    while ( (*s) ) 
-         lcd_data(ctrl, *s++);
+    uint8_t len = 0;
+
+    while ( s[len] )
+         len++;
+
+    lcd_data_burst(ctrl, (const uint8_t*)s, len);
 
 }/* lcd_puts */
 
 
 /*************************************************************************
-Initialize display
-Returns:  0 on failure, 1 else
+Initialize display. The init is split into three steps, so the caller
+can do other work during the delays in between. Several controllers
+are initialized at once and probed separately at the end
 *************************************************************************/
-uint8_t lcd_init(uint8_t ctrl)
+
+/*************************************************************************
+Start the init, at least 15ms after power-on
+Input:    bitmap of controllers
+Returns:  none
+*************************************************************************/
+void lcd_init_start(uint8_t ctrl)
 {
     /*
      *  Initialize LCD to 4 bit I/O mode
@@ -263,15 +433,26 @@ uint8_t lcd_init(uint8_t ctrl)
     DDR(LCD_RW_PORT)    |= _BV(LCD_RW_PIN);
     DDR(LCD_E_PORT)     |= _BV(LCD_E0_PIN);  /* first controller   */
     DDR(LCD_E_PORT)     |= _BV(LCD_E1_PIN);  /* seconds controller */
-  
-    delay(16000);        /* wait 16ms or more after power-on       */
+
+    lcd_rs_low();
+    lcd_rw_low();
 
     /* initial write to lcd is 8bit */
     LCD_DATA_PORT = (LCD_DATA_PORT & 0x0F) | _BV(LCD_FUNCTION) | 
       _BV(LCD_FUNCTION_8BIT);
     lcd_e_toggle(ctrl);
-    delay(4992);         /* delay, busy flag can't be checked here */
-   
+}
+
+/*************************************************************************
+Switch to 4 bit mode and probe the controllers, at least 4.1ms after
+lcd_init_start(). Found controllers are switched off and cleared
+Input:    bitmap of controllers
+Returns:  bitmap of controllers found
+*************************************************************************/
+uint8_t lcd_init_probe(uint8_t ctrl)
+{
+    uint8_t found = 0, c;
+
     /* repeat last command */ 
     lcd_e_toggle(ctrl);      
     delay(64);           /* delay, busy flag can't be checked here */
@@ -287,26 +468,43 @@ uint8_t lcd_init(uint8_t ctrl)
 
     /* from now the LCD only accepts 4 bit I/O, we can use lcd_command() */    
 
-    /* try to find out of there's a controller and return 0 if not */
+    /* try to find out which controllers are there */
+    for(c = LCD_CTRL_0; c <= LCD_CTRL_1; c <<= 1) {
+        if(!(ctrl & c))
+            continue;
+
+        /* display must not be busy anymore */
+        if(lcd_read_busy(c))
+            continue;
+
+        /* function set: display lines  */
+        lcd_command(c, LCD_FUNCTION_DEFAULT);
 
-    /* display must not be busy anymore */
-    if((lcd_read(ctrl, 0)) & (1<<LCD_BUSY))
-      return 0;
+        /* wait some time */
+        delay(64);
 
-    /* function set: display lines  */
-    lcd_command(ctrl, LCD_FUNCTION_DEFAULT);
+        /* display must not be busy anymore */
+        if(lcd_read_busy(c))
+            continue;
 
-    /* wait some time */
-    delay(64);
+        found |= c;
+    }
 
-    /* display must not be busy anymore */
-    if((lcd_read(ctrl, 0)) & (1<<LCD_BUSY))
-      return 0;
+    if(found) {
+        lcd_command(found, LCD_DISP_OFF);    /* display off                  */
+        lcd_clrscr(found);                   /* display clear                */
+    }
+
+    return found;
+}
 
-    lcd_command(ctrl, LCD_DISP_OFF);         /* display off                  */
-    lcd_clrscr(ctrl);                        /* display clear                */
+/*************************************************************************
+Complete the init, lcd_busy() tells when the display clear is done
+Input:    bitmap of controllers found by lcd_init_probe()
+Returns:  none
+*************************************************************************/
+void lcd_init_finish(uint8_t ctrl)
+{
     lcd_command(ctrl, LCD_MODE_DEFAULT);     /* set entry mode               */
     lcd_command(ctrl, LCD_DISP_ON);          /* display/cursor control       */
-  
-    return 1;
-}/* lcd_init */
+}
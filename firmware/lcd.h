@@ -132,14 +132,28 @@
 
 
 /**
- @brief    Initialize display and select type of cursor
- @param    dispAttr \b LCD_DISP_OFF display off\n
-                    \b LCD_DISP_ON display on, cursor off\n
-                    \b LCD_DISP_ON_CURSOR display on, cursor on\n
-                    \b LCD_DISP_ON_CURSOR_BLINK display on, cursor on flashing             
- @return  0 on failure, 1 on success
+ @brief    Start the init of the display, at least 15ms after power-on
+ @param    ctrl bitmap of controllers to initialize at once
+ @return   none
 */
-extern uint8_t lcd_init(uint8_t ctrl);
+extern void lcd_init_start(uint8_t ctrl);
+
+/**
+ @brief    Continue the init at least 4.1ms after lcd_init_start()
+ 
+ Probes the controllers one by one, found controllers are switched
+ off and cleared
+ @param    ctrl bitmap of controllers
+ @return   bitmap of controllers found
+*/
+extern uint8_t lcd_init_probe(uint8_t ctrl);
+
+/**
+ @brief    Complete the init once lcd_busy() returns 0
+ @param    ctrl bitmap of controllers found by lcd_init_probe()
+ @return   none
+*/
+extern void lcd_init_finish(uint8_t ctrl);
 
 
 /**
@@ -173,5 +187,33 @@ extern void lcd_command(uint8_t ctrl, uint8_t cmd);
 */
 extern void lcd_data(uint8_t ctrl, uint8_t data);
 
+/**
+ @brief    Send a run of data bytes to LCD controllers
+
+ Waits for the controllers before each byte like lcd_data(), but sets
+ up the lcd lines only once unless the busy flag has to be read
+ @param    ctrl bitmap of controllers
+ @param    data bytes to send
+ @param    len number of bytes
+ @return   none
+*/
+extern void lcd_data_burst(uint8_t ctrl, const uint8_t *data, uint8_t len);
+
+/**
+ @brief    Check busy flag of LCD controllers
+ @param    ctrl bitmap of controllers to check
+ @return   1 if any of the controllers is still busy, 0 else
+*/
+extern uint8_t lcd_busy(uint8_t ctrl);
+
+/**
+ @brief    Time instructions instead of reading the busy flag
+ 
+ Uses timer 2. Clear and home are still followed by busy flag reads
+ @param    on 1 to switch timed mode on, 0 to switch it off
+ @return   none
+*/
+extern void lcd_set_timed(uint8_t on);
+
 /*@}*/
 #endif //LCD_H
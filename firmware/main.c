@@ -13,6 +13,7 @@
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <avr/eeprom.h>
+#include <string.h>
 
 #include <util/delay.h>
 
@@ -23,10 +24,29 @@
 #include "oddebug.h"
 
 #define VERSION_MAJOR 1
-#define VERSION_MINOR 9
-#define VERSION_STR "1.09"
+#define VERSION_MINOR 11
+#define VERSION_STR "1.11"
 // change USB_CFG_DEVICE_VERSION in usbconfig.h as well
 
+/* optional features, each one may be left out by defining its switch */
+/* as 0 (see Makefile) if the firmware doesn't fit into the flash */
+#ifndef WITH_FADE
+#define WITH_FADE    1          /* fade engine */
+#endif
+#ifndef WITH_FB
+#define WITH_FB      1          /* copy of the ddram contents */
+#endif
+#ifndef WITH_TICKER
+#define WITH_TICKER  1          /* ticker scrolled by the firmware */
+#endif
+#ifndef WITH_MACROS
+#define WITH_MACROS  1          /* command macros in eeprom */
+#endif
+
+#if WITH_TICKER && !WITH_FB
+#error "the ticker needs the framebuffer, set WITH_TICKER to 0 as well"
+#endif
+
 // EEMEM wird bei aktuellen Versionen der avr-lib in eeprom.h definiert
 // hier: definiere falls noch nicht bekannt ("alte" avr-libc)
 #ifndef EEMEM
@@ -34,8 +54,9 @@
 #define EEMEM  __attribute__ ((section (".eeprom")))
 #endif
  
-/* bitmask of detected lcd controllers */
-uchar controller = 0;
+/* bitmask of detected lcd controllers, both are assumed to be there */
+/* until the init has probed them */
+uchar controller = LCD_CTRL_0 | LCD_CTRL_1;
 
 /* ------------------------------------------------------------------------- */
 /* PWM units are used for contrast and backlight brightness */
@@ -45,6 +66,9 @@ uchar eeprom_valid EEMEM;
 uchar eeprom_contrast EEMEM;
 uchar eeprom_brightness EEMEM;
 
+/* current settings */
+uchar contrast, brightness;
+
 void pwm_init(void) {
 
   /* check if eeprom is valid and set default values if not */
@@ -75,24 +99,926 @@ void pwm_init(void) {
 
   TIMSK &=( (~_BV(2)) & (~_BV(3)) & (~_BV(4)) & (~_BV(5)));
 
-  OCR1A = eeprom_read_byte(&eeprom_contrast);
-  OCR1B = eeprom_read_byte(&eeprom_brightness);
+  OCR1A = contrast = eeprom_read_byte(&eeprom_contrast);
+  OCR1B = brightness = eeprom_read_byte(&eeprom_brightness);
 }
 
-void set_contrast(uchar value) {
-  /* store value in eeprom if it actually changed */
-  if(value != eeprom_read_byte(&eeprom_contrast))
-    eeprom_write_byte(&eeprom_contrast, value);
+/* ------------------------------------------------------------------------- */
+/* An eeprom write takes 8.5ms and the eeprom only survives about       */
+/* 100000 of them. New values are thus applied to the PWM at once but   */
+/* only written to eeprom once they haven't changed for a while         */
+
+#define PERSIST_DELAY  20       /* default delay in 100ms units */
+
+uchar persist_delay = PERSIST_DELAY;  /* 0 = don't save automatically */
+uint16_t persist_timer = 0;     /* ms until settings are saved, 0 = idle */
+uchar persist_pending = 0;      /* settings are being saved */
+
+/* restart the persistence delay after a change */
+void persist_touch(void) {
+  if(persist_delay)
+    persist_timer = persist_delay * 100;
+}
+
+/* called from the main loop. Saves settings once the delay has */
+/* expired, one byte per call and only when the eeprom is ready */
+void persist_poll(uchar ms) {
+  if(persist_timer) {
+    if(persist_timer > ms)
+      persist_timer -= ms;
+    else {
+      persist_timer = 0;
+      persist_pending = 1;
+    }
+  }
+
+  if(!persist_pending || !eeprom_is_ready())
+    return;
+
+  /* store values in eeprom if they actually changed */
+  if(contrast != eeprom_read_byte(&eeprom_contrast))
+    eeprom_write_byte(&eeprom_contrast, contrast);
+  else if(brightness != eeprom_read_byte(&eeprom_brightness))
+    eeprom_write_byte(&eeprom_brightness, brightness);
+  else
+    persist_pending = 0;
+}
 
+/* ------------------------------------------------------------------------- */
+/* The fade engine ramps contrast or brightness to a target value within */
+/* a given time. With the gamma option the ramp runs on the square root  */
+/* of the pwm value, which looks more even to the human eye              */
+
+#define FADE_BRIGHTNESS  0x01   /* fade brightness, contrast otherwise */
+#define FADE_GAMMA       0x02   /* perceptually even ramp */
+
+#if WITH_FADE
+struct fade {
+  uchar from, to, flags;
+  uint16_t time, duration;      /* in ms, duration 0 = not fading */
+} fade[2];                      /* contrast and brightness */
+#endif
+
+void set_contrast(uchar value) {
+#if WITH_FADE
+  fade[0].duration = 0;
+#endif
+  contrast = value;
   OCR1A = value;  // lower voltage is higher contrast
+  persist_touch();
 }
 
 void set_brightness(uchar value) {
-  /* store value in eeprom if it actually changed */
-  if(value != eeprom_read_byte(&eeprom_brightness))
-    eeprom_write_byte(&eeprom_brightness, value);
-
+#if WITH_FADE
+  fade[1].duration = 0;
+#endif
+  brightness = value;
   OCR1B = value;  // higher voltage is higher brightness
+  persist_touch();
+}
+
+#if WITH_FADE
+/* integer square root */
+uchar isqrt(uint16_t x) {
+  uchar r = 0, b;
+
+  for(b = 0x80; b; b >>= 1)
+    if((uint16_t)(r | b) * (r | b) <= x)
+      r |= b;
+
+  return r;
+}
+
+void fade_start(uchar flags, uchar value, uint16_t duration) {
+  struct fade *f = &fade[flags & FADE_BRIGHTNESS];
+
+  /* start at the current output, a running fade is taken over */
+  f->from = (flags & FADE_BRIGHTNESS)?OCR1B:OCR1A;
+  f->to = value;
+  f->flags = flags;
+  f->time = 0;
+
+  if(!duration) {
+    if(flags & FADE_BRIGHTNESS) set_brightness(value);
+    else                        set_contrast(value);
+  }
+
+  f->duration = duration;
+}
+
+/* called from the main loop with the time passed since the last call */
+void fade_poll(uchar ms) {
+  struct fade *f;
+  uchar c, from, to, value;
+
+  if(!ms)
+    return;
+
+  for(c=0;c<2;c++) {
+    f = &fade[c];
+    if(!f->duration)
+      continue;
+
+    f->time += ms;
+    if(f->time >= f->duration) {
+      /* done, the final value is saved like any other setting */
+      if(c) set_brightness(f->to);
+      else  set_contrast(f->to);
+      continue;
+    }
+
+    from = f->from;
+    to = f->to;
+    if(f->flags & FADE_GAMMA) {
+      from = isqrt((uint16_t)from * 255);
+      to = isqrt((uint16_t)to * 255);
+    }
+
+    value = from + (int32_t)(to - from) * f->time / f->duration;
+
+    if(f->flags & FADE_GAMMA) 
+      value = (uint16_t)value * value / 255;
+
+    if(c) OCR1B = value;
+    else  OCR1A = value;
+  }
+}
+#else
+#define fade_poll(ms)
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* Timer 0 runs freely at F_CPU/1024, i.e. 750/64 counts per ms. The     */
+/* main loop derives a millisecond clock from it. It only has to read    */
+/* the counter at least once per timer overflow (21.8ms)                 */
+
+uint16_t clock_ms = 0;          /* wraps after 65.5 seconds */
+uint16_t clock_frac = 0;        /* fraction of a ms in 1/64 counts */
+uchar clock_last = 0;           /* timer value at last clock_poll() */
+
+void clock_init(void) {
+  TCCR0 = _BV(CS02) | _BV(CS00);  // prescaler 1024
+}
+
+/* update clock, returns the number of ms passed since the last call */
+uchar clock_poll(void) {
+  uchar now = TCNT0, ms = 0;
+
+  clock_frac += (uint16_t)(uchar)(now - clock_last) << 6;
+  clock_last = now;
+
+  while(clock_frac >= 750) {
+    clock_frac -= 750;
+    ms++;
+  }
+
+  clock_ms += ms;
+  return ms;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Key changes are debounced and sent to the host via the interrupt in   */
+/* endpoint. Each event consists of four bytes: the new key bitmap, the  */
+/* bitmap of changed keys (bit 7 set if events have been lost before)    */
+/* and the time of the first edge in ms (16 bit, lsb first)              */
+
+#define KEY_DEBOUNCE  10        /* ms a key has to be stable */
+#define KEY_EVENTS    8         /* event queue, power of two */
+#define KEY_LOST      0x80      /* events have been lost before this one */
+
+uchar key_raw = 0;              /* last sampled state */
+uchar key_stable = 0;           /* ms key_raw has been stable */
+uint16_t key_time;              /* time of last edge */
+uchar key_state = 0;            /* debounced state */
+uchar key_event[KEY_EVENTS][4];
+uchar key_head = 0, key_tail = 0;
+uchar key_lost = 0;
+
+uchar keys_read(void) {
+  return ((PINC & _BV(5))?0:1) | ((PINB & _BV(0))?0:2);
+}
+
+/* called from the main loop with the time passed since the last call */
+void keys_poll(uchar ms) {
+  uchar raw = keys_read(), *ev;
+
+  if(raw != key_raw) {
+    key_raw = raw;
+    key_time = clock_ms;
+    key_stable = 0;
+  } else if(key_stable < KEY_DEBOUNCE) 
+    key_stable += ms;
+
+  if((key_stable >= KEY_DEBOUNCE) && (key_raw != key_state)) {
+    if((uchar)(key_head - key_tail) == KEY_EVENTS)
+      key_lost = KEY_LOST;   // host doesn't fetch events
+    else {
+      ev = key_event[key_head++ & (KEY_EVENTS-1)];
+      ev[0] = key_raw;
+      ev[1] = (key_raw ^ key_state) | key_lost;
+      ev[2] = key_time & 0xff;
+      ev[3] = key_time >> 8;
+      key_lost = 0;
+    }
+    key_state = key_raw;
+  }
+
+  // pass next event to the driver once the previous one has been fetched
+  if((key_head != key_tail) && usbInterruptIsReady())
+    usbSetInterrupt(key_event[key_tail++ & (KEY_EVENTS-1)], 4);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Commands and data received via usb are not written to the display   */
+/* from within usbFunctionSetup() since the lcd needs up to 1.5ms to    */
+/* execute an instruction. Instead they are queued and written from the */
+/* main loop whenever the display is ready                              */
+
+#define QUEUE_SIZE  64          /* entries, power of two and max 128 */
+#define QUEUE_RS    0x80        /* entry is data, not a command */
+#define QUEUE_BURST 8           /* max data bytes written in one go */
+
+uchar queue_tag[QUEUE_SIZE];    /* controller bitmap and QUEUE_RS flag */
+uchar queue_val[QUEUE_SIZE];
+uchar queue_head = 0;           /* free running counters, the index */
+uchar queue_tail = 0;           /* is taken modulo QUEUE_SIZE */
+uchar queue_overflows = 0;      /* times the queue was full */
+
+#define queue_used()  ((uchar)(queue_head - queue_tail))
+
+#if WITH_FB
+void fb_track(uchar tag, uchar val);
+void fb_lost(uchar tag);
+#else
+#define fb_track(tag, val)
+#define fb_lost(tag)
+#endif
+uchar init_done(void);
+
+/* write oldest entry to the display, entries queued before the init */
+/* may address a controller that isn't there */
+void queue_write(void) {
+  uchar i = queue_tail & (QUEUE_SIZE-1);
+  uchar ctrl = queue_tag[i] & controller;
+
+  if(ctrl) {
+    if(queue_tag[i] & QUEUE_RS)
+      lcd_data(ctrl, queue_val[i]);
+    else
+      lcd_command(ctrl, queue_val[i]);
+  }
+
+  queue_tail++;
+}
+
+void queue_put(uchar tag, uchar val) {
+  uchar i;
+
+  /* queue full: the entry is dropped, writing it to the display right */
+  /* now would keep usbFunctionSetup() busy. Hosts learn about it from */
+  /* the overflow counter */
+  if(queue_used() == QUEUE_SIZE) {
+    if(queue_overflows != 0xff)
+      queue_overflows++;
+
+    fb_lost(tag);
+    return;
+  }
+
+  i = queue_head & (QUEUE_SIZE-1);
+  queue_tag[i] = tag;
+  queue_val[i] = val;
+  queue_head++;
+
+  fb_track(tag, val);
+}
+
+/* called from the main loop, write one entry if display is ready. A */
+/* run of data bytes for the same controllers is written in a burst of */
+/* up to one usb packet's size, the main loop waits ~45us per byte */
+void queue_poll(void) {
+  uchar i = queue_tail & (QUEUE_SIZE-1);
+  uchar tag = queue_tag[i];
+  uchar n;
+
+  if(!init_done() || (queue_head == queue_tail) || 
+     lcd_busy(tag & controller))
+    return;
+
+  if(!(tag & QUEUE_RS) || !(tag & controller)) {
+    queue_write();
+    return;
+  }
+
+  // the run ends at the end of the ring buffer
+  for(n=1;(n < QUEUE_BURST) && (n < queue_used()) && 
+	(i+n < QUEUE_SIZE) && (queue_tag[i+n] == tag);n++);
+
+  lcd_data_burst(tag & controller, &queue_val[i], n);
+  queue_tail += n;
+}
+
+/* ------------------------------------------------------------------------- */
+/* The firmware keeps a copy of the ddram contents of both controllers. */
+/* Everything queued for the display is followed to keep it and the     */
+/* controllers' address counters up to date. Framebuffer writes only    */
+/* queue the cells that differ from the copy and only send an address   */
+/* command if the address counter doesn't point to the cell already     */
+
+#define FB_LINE     40          /* characters per ddram line */
+#define FB_SIZE     (2*FB_LINE) /* cells per controller, line 1 follows line 0 */
+#define FB_UNKNOWN  0xff        /* address counter isn't known */
+
+/* set ddram address command for a cell */
+#define FB_ADDR(i)  (0x80 | (((i) < FB_LINE)?(i):0x40 + (i) - FB_LINE))
+
+#if WITH_FB
+uchar fb_cell[2][FB_SIZE];      /* ddram contents */
+uchar fb_known[2][FB_SIZE/8];   /* bitmap of cells with known contents */
+uchar fb_ac[2] = { FB_UNKNOWN, FB_UNKNOWN };  /* address counter as cell */
+uchar fb_inc = LCD_CTRL_0 | LCD_CTRL_1;      /* address counter increments */
+uchar fb_cgram = 0;             /* address counter points into cgram */
+
+/* follow an entry queued for the display */
+void fb_track(uchar tag, uchar val) {
+  uchar c, bit;
+
+  for(c=0;c<2;c++) {
+    bit = c?LCD_CTRL_1:LCD_CTRL_0;
+    if(!(tag & bit))
+      continue;
+
+    if(tag & QUEUE_RS) {
+      // glyph data doesn't touch the ddram
+      if(fb_cgram & bit)
+	continue;
+
+      // data written to an unknown place may have replaced any cell
+      if(fb_ac[c] == FB_UNKNOWN) {
+	memset(fb_known[c], 0, sizeof(fb_known[c]));
+	continue;
+      }
+
+      fb_cell[c][fb_ac[c]] = val;
+      fb_known[c][fb_ac[c] >> 3] |= _BV(fb_ac[c] & 7);
+
+      if(!(fb_inc & bit))
+	fb_ac[c] = FB_UNKNOWN;
+      else if(++fb_ac[c] == FB_SIZE)
+	fb_ac[c] = 0;
+    } else if(val & 0x80) {            // set ddram address
+      fb_ac[c] = ((val & 0x3f) < FB_LINE)?
+	((val & 0x40)?FB_LINE:0) + (val & 0x3f):FB_UNKNOWN;
+      fb_cgram &= ~bit;
+    } else if(val == 0x01) {           // clear display
+      memset(fb_cell[c], ' ', sizeof(fb_cell[c]));
+      memset(fb_known[c], 0xff, sizeof(fb_known[c]));
+      fb_ac[c] = 0;
+      fb_inc |= bit;
+      fb_cgram &= ~bit;
+    } else if((val & 0xfe) == 0x02) {  // return home
+      fb_ac[c] = 0;
+      fb_cgram &= ~bit;
+    } else if((val & 0xfc) == 0x04) {  // entry mode
+      if(val & 0x02) fb_inc |= bit;
+      else           fb_inc &= ~bit;
+    } else if((val & 0xc0) == 0x40) {  // set cgram address
+      fb_ac[c] = FB_UNKNOWN;
+      fb_cgram |= bit;
+    } else if((val & 0xf8) == 0x10) {  // cursor move
+      fb_ac[c] = FB_UNKNOWN;
+    }
+  }
+}
+
+/* an entry for the controllers in tag has been dropped, their address */
+/* counters may not be where the copy expects them anymore */
+void fb_lost(uchar tag) {
+  if(tag & LCD_CTRL_0) fb_ac[0] = FB_UNKNOWN;
+  if(tag & LCD_CTRL_1) fb_ac[1] = FB_UNKNOWN;
+}
+
+/* cell i of controller c is known to show val */
+#define fb_same(c, i, val) \
+  ((fb_known[c][(i) >> 3] & _BV((i) & 7)) && (fb_cell[c][i] == (val)))
+
+/* write a cell of controller c through the framebuffer */
+void fb_write(uchar c, uchar i, uchar val) {
+  uchar ctrl = c?LCD_CTRL_1:LCD_CTRL_0;
+
+  if(fb_same(c, i, val))
+    return;
+
+  if(fb_ac[c] != i)
+    queue_put(ctrl, FB_ADDR(i));
+
+  queue_put(ctrl | QUEUE_RS, val);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* Long transfers carry a stream of segments in the data stage of a      */
+/* control-out transfer. Each segment starts with a header byte: bit 7   */
+/* set for data, cleared for commands, bits 0..6 = number of bytes - 1.  */
+/* Segments may span several usb packets. With bit 0 of value set the   */
+/* data stage consists of groups of up to eight bytes instead, each      */
+/* preceded by a bitmap with bit n set if byte n of the group is data.   */
+/* With the R bit set in the request it carries cells for the            */
+/* framebuffer, starting at the cell given in the lsb of value. The      */
+/* text of a ticker and macros are received the same way                 */
+
+#define LONG_RS     0x80        /* segment header: data follows */
+#define LONG_MIXED  0x01        /* value: groups with rs bitmap */
+
+usbMsgLen_t long_left = 0;      /* bytes left in data stage */
+uchar long_target;              /* controllers addressed */
+uchar long_segment = 0;         /* bytes left in segment, 0 = header next */
+uchar long_tag;                 /* queue tag of current segment */
+uchar long_mixed;               /* groups with rs bitmap */
+uchar long_bitmap;              /* rs bitmap of current group */
+uchar long_fb;                  /* cells for the framebuffer */
+uchar long_cell;                /* next framebuffer cell */
+uchar long_ticker = 0;          /* text of the ticker */
+uchar long_macro = 0;           /* macro request, see below */
+uchar long_room = 8;            /* queue entries a packet may need */
+
+#define LONG_MACRO_WRITE  1     /* bytes of a macro to be stored */
+#define LONG_MACRO_PLAY   2     /* held off while a macro is played */
+#define LONG_MACRO_STALL  3     /* rejected macro request */
+
+#if WITH_TICKER
+void ticker_put(uchar val);
+#else
+#define ticker_put(val)
+#endif
+#if WITH_MACROS
+void macro_put(uchar val);
+uchar macro_busy(void);
+#else
+#define macro_put(val)
+#define macro_busy()  0
+#endif
+
+/* a usb packet may carry up to 8 bytes, each framebuffer cell may */
+/* need an address command as well, for each controller */
+#define queue_room()  (QUEUE_SIZE - queue_used() >= long_room)
+
+uchar usbFunctionWrite(uchar *data, uchar len) {
+  uchar i;
+
+  if(long_macro == LONG_MACRO_STALL)
+    return 0xff;
+
+  if(len > long_left) 
+    len = long_left;
+
+  for(i=0;i<len;i++) {
+    if(long_ticker) {
+      ticker_put(data[i]);
+    } else if(long_macro) {
+      macro_put(data[i]);
+#if WITH_FB
+    } else if(long_fb) {
+      if(long_target & LCD_CTRL_0)
+	fb_write(0, long_cell, data[i]);
+      if(long_target & LCD_CTRL_1)
+	fb_write(1, long_cell, data[i]);
+
+      if(++long_cell == FB_SIZE)
+	long_cell = 0;
+#endif
+    } else if(long_mixed) {
+      if(!long_segment) {
+	long_bitmap = data[i];
+	long_segment = 8;
+      } else {
+	if(long_target)
+	  queue_put(long_target | ((long_bitmap & 1)?QUEUE_RS:0), data[i]);
+	long_bitmap >>= 1;
+	long_segment--;
+      }
+    } else if(!long_segment) {
+      long_tag = long_target | ((data[i] & LONG_RS)?QUEUE_RS:0);
+      long_segment = (data[i] & ~LONG_RS) + 1;
+    } else {
+      if(long_target) // at least one controller should be used ...
+	queue_put(long_tag, data[i]);
+      long_segment--;
+    }
+  }
+
+  long_left -= len;
+  if(!long_left)
+    return 1;   // transfer complete
+
+  // the next packet may not fit into the queue or the macro buffer:
+  // let the host wait until the main loop has written enough bytes to
+  // the display or the eeprom
+  if(!queue_room() || (long_macro && macro_busy()))
+    usbDisableAllRequests();
+
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* A ticker scrolls a text of up to 80 characters through a window of   */
+/* cells by itself, so the host doesn't have to send anything while it */
+/* runs. Each step rewrites the window through the framebuffer and then */
+/* sets the address counter back to where it was, so host writes to    */
+/* other cells keep working. The display shift isn't used since it      */
+/* would move all lines of the controller                               */
+
+#if WITH_TICKER
+#define TICKER_MAX  FB_SIZE     /* characters of text */
+
+uchar ticker_text[TICKER_MAX];
+uchar ticker_len = 0;           /* characters of text, 0 = stopped */
+uchar ticker_ctrl;              /* controller showing the ticker */
+uchar ticker_cell;              /* first cell of the window */
+uchar ticker_width;             /* cells in the window */
+uchar ticker_pos = 0;           /* text index shown in the first cell */
+uint16_t ticker_interval;       /* ms per step, 0 = don't scroll */
+uint16_t ticker_timer = 0;      /* ms until the next step */
+
+/* a new text is being received, an empty text stops the ticker */
+void ticker_start(uchar ctrl, uchar cell, uchar width, uint16_t interval) {
+  ticker_len = 0;
+  ticker_pos = 0;
+  ticker_timer = 0;
+
+  // a single controller, the window has to fit into the queue
+  ticker_ctrl = (ctrl & LCD_CTRL_0)?LCD_CTRL_0:(ctrl & LCD_CTRL_1);
+  ticker_cell = cell % FB_SIZE;
+  ticker_width = (width > FB_LINE)?FB_LINE:width;
+  ticker_interval = interval;
+}
+
+void ticker_put(uchar val) {
+  if(ticker_len < TICKER_MAX)
+    ticker_text[ticker_len++] = val;
+}
+
+/* queue entries the next step needs: the changed cells, an address */
+/* command before each run of them and one to restore the address */
+/* counter. The address counter is known and increments */
+uchar ticker_entries(uchar c) {
+  uchar i, cell, n = 1, ac = fb_ac[c];
+
+  for(i=0;i<ticker_width;i++) {
+    cell = (ticker_cell + i) % FB_SIZE;
+    if(fb_same(c, cell, ticker_text[(ticker_pos + i) % ticker_len]))
+      continue;
+
+    n += (cell == ac)?1:2;
+    ac = (cell + 1) % FB_SIZE;
+  }
+
+  return n;
+}
+
+void ticker_poll(uchar ms) {
+  uchar c, i, ac;
+
+  if(!ticker_len || !ticker_ctrl || !ticker_width)
+    return;
+
+  if(ticker_timer > ms) {
+    ticker_timer -= ms;
+    return;
+  }
+  ticker_timer = 0;
+
+  // a long transfer may continue at the address counter
+  if(!init_done() || long_left)
+    return;
+
+  // the host may be writing to cgram or moving the cursor by itself,
+  // the address counter can't be restored then. A step also waits
+  // until all of it fits into the queue
+  c = (ticker_ctrl & LCD_CTRL_1)?1:0;
+  ac = fb_ac[c];
+  if((ac == FB_UNKNOWN) || !(fb_inc & ticker_ctrl) ||
+     (QUEUE_SIZE - queue_used() < ticker_entries(c)))
+    return;
+
+  for(i=0;i<ticker_width;i++)
+    fb_write(c, (ticker_cell + i) % FB_SIZE, 
+	     ticker_text[(ticker_pos + i) % ticker_len]);
+
+  if(fb_ac[c] != ac)
+    queue_put(ticker_ctrl, FB_ADDR(ac));
+
+  if(!ticker_interval) {
+    ticker_len = 0;             // shown once, nothing to scroll
+    return;
+  }
+
+  if(++ticker_pos == ticker_len)
+    ticker_pos = 0;
+  ticker_timer = ticker_interval;
+}
+#else
+#define ticker_poll(ms)
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* Macros are sequences of commands and data stored in the eeprom, so   */
+/* e.g. user defined characters or a screen layout can be written with  */
+/* a single request. They are stored as segments like long transfers    */
+/* carry them. The host sends a macro in parts and sets its length at   */
+/* the end, the slot is empty meanwhile. Each changed byte takes an     */
+/* 8.5ms eeprom write, so the data packets of a part are held off until */
+/* the previous one has been stored. Bytes still being stored after a  */
+/* part or the length are reported in the device state, macro requests */
+/* arriving meanwhile are rejected. A macro is played from the main     */
+/* loop as the queue has room, a data stage of the request is held off  */
+/* until all of it has been queued                                      */
+
+#if WITH_MACROS
+#define MACRO_SLOTS  4
+#define MACRO_SIZE   125        /* bytes per macro, all fit into 512 bytes */
+#define MACRO_EMPTY  0xff       /* length of an empty slot */
+
+#define MACRO_PLAY   0          /* msb of value: write macro to display */
+#define MACRO_WRITE  1          /* store data stage at offset in index */
+#define MACRO_END    2          /* set length of macro to index */
+
+uchar eeprom_macro_len[MACRO_SLOTS] EEMEM;
+uchar eeprom_macro[MACRO_SLOTS][MACRO_SIZE] EEMEM;
+
+uchar macro_slot;               /* slot being stored */
+uchar macro_pos;                /* offset of next byte to be stored */
+uchar macro_buf[8];             /* bytes of a usb packet to be stored */
+uchar macro_fill = 0;           /* bytes in macro_buf */
+uchar macro_done = 0;           /* bytes of macro_buf stored */
+uchar macro_len;                /* length to be stored before the bytes */
+uchar macro_len_pending = 0;
+
+uchar macro_play_target = 0;    /* controllers of macro being played */
+uchar macro_play_slot;
+uchar macro_play_pos;           /* offset of next byte to be queued */
+uchar macro_play_len;           /* MACRO_EMPTY until it has been read */
+uchar macro_play_tag;           /* queue tag of current segment */
+uchar macro_play_segment;       /* bytes left in segment, 0 = header next */
+
+uchar macro_busy(void) {
+  return macro_len_pending || (macro_done != macro_fill) || macro_play_target;
+}
+
+/* handle a macro request, returns the length of its data stage */
+usbMsgLen_t macro_request(uchar target, uchar slot, uchar op, 
+			  uint16_t index, usbMsgLen_t len) {
+  long_macro = LONG_MACRO_STALL;
+
+  if((slot >= MACRO_SLOTS) || macro_busy())
+    return len;
+
+  switch(op) {
+  case MACRO_PLAY:
+    if(target) {
+      macro_play_target = target;
+      macro_play_slot = slot;
+      macro_play_pos = 0;
+      macro_play_len = MACRO_EMPTY;
+      macro_play_segment = 0;
+
+      // the setup packet has already been accepted at this point, so
+      // requests sent later can be held off by refusing the data stage
+      if(len)
+	usbDisableAllRequests();
+    }
+
+    long_macro = LONG_MACRO_PLAY;
+    return len;
+
+  case MACRO_WRITE:
+    if((index > MACRO_SIZE) || (len > MACRO_SIZE - index))
+      return len;
+
+    macro_slot = slot;
+    macro_pos = index;
+
+    // the first part invalidates the slot
+    if(!index) {
+      macro_len = MACRO_EMPTY;
+      macro_len_pending = 1;
+    }
+
+    long_macro = LONG_MACRO_WRITE;
+    return len;
+
+  case MACRO_END:
+    if(index > MACRO_SIZE)
+      return len;
+
+    macro_slot = slot;
+    macro_len = index;
+    macro_len_pending = 1;
+    long_macro = LONG_MACRO_WRITE;
+    return len;
+  }
+
+  return len;
+}
+
+/* called by usbFunctionWrite(), the previous packet has been stored */
+void macro_put(uchar val) {
+  if(long_macro != LONG_MACRO_WRITE)
+    return;                     // data stage of a play request
+
+  if(macro_done == macro_fill)
+    macro_done = macro_fill = 0;
+
+  macro_buf[macro_fill++] = val;
+}
+
+/* called from the main loop, stores a byte whenever the eeprom is */
+/* ready. Bytes that don't change aren't written */
+void macro_store_poll(void) {
+  if(macro_len_pending) {
+    if(eeprom_read_byte(&eeprom_macro_len[macro_slot]) != macro_len)
+      eeprom_write_byte(&eeprom_macro_len[macro_slot], macro_len);
+    macro_len_pending = 0;
+  } else if(macro_done != macro_fill) {
+    if(eeprom_read_byte(&eeprom_macro[macro_slot][macro_pos]) != 
+       macro_buf[macro_done])
+      eeprom_write_byte(&eeprom_macro[macro_slot][macro_pos], 
+			macro_buf[macro_done]);
+    macro_pos++;
+    macro_done++;
+  }
+}
+
+/* called from the main loop, queues up to a burst of the macro being */
+/* played while there's room */
+void macro_play_poll(void) {
+  uchar n, val;
+
+  if(macro_play_len == MACRO_EMPTY) {
+    macro_play_len = eeprom_read_byte(&eeprom_macro_len[macro_play_slot]);
+    if(macro_play_len > MACRO_SIZE)
+      macro_play_len = 0;       // empty slot
+  }
+
+  for(n=0;(n < QUEUE_BURST) && (macro_play_pos < macro_play_len) &&
+	(queue_used() < QUEUE_SIZE);n++) {
+    val = eeprom_read_byte(&eeprom_macro[macro_play_slot][macro_play_pos++]);
+
+    if(!macro_play_segment) {
+      macro_play_tag = macro_play_target | ((val & LONG_RS)?QUEUE_RS:0);
+      macro_play_segment = (val & ~LONG_RS) + 1;
+    } else {
+      queue_put(macro_play_tag, val);
+      macro_play_segment--;
+    }
+  }
+
+  if(macro_play_pos == macro_play_len)
+    macro_play_target = 0;
+}
+
+void macro_poll(void) {
+  // eeprom reads wait for a write in progress
+  if(!eeprom_is_ready())
+    return;
+
+  if(macro_play_target)
+    macro_play_poll();
+  else
+    macro_store_poll();
+}
+#else
+#define macro_poll()
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* The displays are initialized from the main loop, so usb requests are  */
+/* served right after power-on. Both controllers go through the init     */
+/* sequence at once and are probed one by one at its end. Requests       */
+/* arriving meanwhile are queued for both controllers, the queue is      */
+/* written once the init is done                                         */
+
+#define INIT_POWER  0           // waiting for the displays to power up
+#define INIT_RESET  1           // first function set sent
+#define INIT_CLEAR  2           // waiting for the display clear
+#define INIT_DONE   3
+
+uchar init_state = INIT_POWER;
+uchar init_timer = 6;           // ms until the next step, the first
+                                // tick may be up to 1ms short. The
+                                // usb reset has taken 10 of the 15ms
+                                // needed after power-on already
+
+uchar init_done(void) {
+  return init_state == INIT_DONE;
+}
+
+/* write the boot message. The framebuffer follows it unless requests */
+/* have been queued during the init, which have been followed already */
+void init_puts(uchar ctrl, const char *s) {
+  lcd_puts(ctrl, s);
+
+  if(!queue_used())
+    for(;*s;s++)
+      fb_track(ctrl | QUEUE_RS, *s);
+}
+
+void init_poll(uchar ms) {
+  if(init_timer > ms) {
+    init_timer -= ms;
+    return;
+  }
+  init_timer = 0;
+
+  switch(init_state) {
+  case INIT_POWER:
+    lcd_init_start(LCD_CTRL_0 | LCD_CTRL_1);
+    init_timer = 6;             // 4.1ms
+    init_state = INIT_RESET;
+    break;
+
+  case INIT_RESET:
+    controller = lcd_init_probe(LCD_CTRL_0 | LCD_CTRL_1);
+    init_state = INIT_CLEAR;
+    break;
+
+  case INIT_CLEAR:
+    if(lcd_busy(controller))
+      break;
+
+    lcd_init_finish(controller);
+
+    // the init has cleared the displays
+    if(!queue_used())
+      fb_track(controller, 0x01);
+
+    /* put string to display (line 1) with linefeed */
+    if(controller & LCD_CTRL_0)
+      init_puts(LCD_CTRL_0, "LCD2USB V" VERSION_STR);
+
+    if(controller & LCD_CTRL_1)
+      init_puts(LCD_CTRL_1, "2nd ctrl");
+
+    if((controller & LCD_CTRL_0) && (controller & LCD_CTRL_1))
+      init_puts(LCD_CTRL_0 | LCD_CTRL_1, " both!");
+
+    init_state = INIT_DONE;
+    break;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+/* The capability descriptor tells the host in a single request what the */
+/* firmware supports and what state the device is in, see README.md      */
+
+#define CAPS_VERSION     1
+#define CAPS_SIZE        14
+
+#define CAPS_LONG        0x0001 /* long transfers */
+#define CAPS_KEY_EVENTS  0x0002 /* key events on the interrupt endpoint */
+#define CAPS_QUEUE_STATE 0x0004 /* command requests report queue state */
+#define CAPS_FADE        0x0008 /* fade engine */
+#define CAPS_PERSIST     0x0010 /* configurable saving of settings */
+#define CAPS_FB          0x0020 /* long transfers of framebuffer cells */
+#define CAPS_GOTO        0x0040 /* address command and data */
+#define CAPS_MIXED       0x0080 /* rs bitmap in short and long requests */
+#define CAPS_TIMED       0x0100 /* timed writes without busy flag reads */
+#define CAPS_TICKER      0x0200 /* ticker scrolled by the firmware */
+#define CAPS_MACROS      0x0400 /* command macros in eeprom */
+
+#define CAPS_FEATURES  (CAPS_LONG | CAPS_KEY_EVENTS | CAPS_QUEUE_STATE | \
+			CAPS_PERSIST | CAPS_GOTO | CAPS_MIXED | CAPS_TIMED | \
+			(WITH_FADE?CAPS_FADE:0) | (WITH_FB?CAPS_FB:0) | \
+			(WITH_TICKER?CAPS_TICKER:0) | (WITH_MACROS?CAPS_MACROS:0))
+
+#define STATE_DETECTING  0x01   /* controllers haven't been probed yet */
+#define STATE_MACRO      0x02   /* a macro is being stored or played */
+
+/* device state as reported in the descriptor and with the controller map */
+uchar state_get(void) {
+  return (init_done()?0:STATE_DETECTING) | (macro_busy()?STATE_MACRO:0);
+}
+
+uchar caps_get(void) {
+  static uchar caps[CAPS_SIZE];
+
+  caps[0] = CAPS_VERSION;
+  caps[1] = CAPS_SIZE;
+  caps[2] = VERSION_MAJOR;
+  caps[3] = VERSION_MINOR;
+  caps[4] = CAPS_FEATURES & 0xff;
+  caps[5] = CAPS_FEATURES >> 8;
+  caps[6] = controller;
+  caps[7] = QUEUE_SIZE;
+  caps[8] = (USB_NO_MSG - 1) & 0xff;   // max data stage of long transfers
+  caps[9] = (USB_NO_MSG - 1) >> 8;
+  caps[10] = contrast;
+  caps[11] = brightness;
+  caps[12] = keys_read();
+  caps[13] = state_get();
+
+  usbMsgPtr = caps;
+  return CAPS_SIZE;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -110,7 +1036,8 @@ uchar	usbFunctionSetup(uchar data[8]) {
   // C C C T T R L L
 
   // TT = target bit map 
-  // R = reserved for future use, set to 0
+  // R = long transfer: framebuffer cells, compound: rs bitmap,
+  //     ticker: macro, reserved otherwise, set to 0
   // LL = number of bytes in transfer - 1 
 
   switch(data[1] >> 5) {
@@ -122,19 +1049,25 @@ uchar	usbFunctionSetup(uchar data[8]) {
     break;
     
   case 1: // command
-    target &= controller;  // mask installed controllers
-
-    if(target) // at least one controller should be used ...
-      for(i=0;i<len;i++)
-	lcd_command(target, data[2+i]);
-    break;
-
   case 2: // data
     target &= controller;  // mask installed controllers
 
-    if(target) // at least one controller should be used ...
+    if(target) { // at least one controller should be used ...
+      if(data[1] & 0x40) 
+	target |= QUEUE_RS;
+
       for(i=0;i<len;i++)
-	lcd_data(target, data[2+i]);
+	queue_put(target, data[2+i]);
+    }
+
+    // a host sending this as control-in transfer gets the number of
+    // free queue entries and how often the queue was full since the
+    // last report
+    replyBuf[0] = QUEUE_SIZE - queue_used();
+    replyBuf[1] = queue_overflows;
+    if(data[0] & 0x80) 
+      queue_overflows = 0;
+    return 2;
     break;
 
   case 3: // set
@@ -148,6 +1081,34 @@ uchar	usbFunctionSetup(uchar data[8]) {
       set_brightness(data[2]);
       break;
 
+    case 2:  // fade to value data[2] with options data[3] within
+             // data[4..5] ms
+#if WITH_FADE
+      fade_start(data[3], data[2], data[4] | (data[5] << 8));
+#endif
+      break;
+
+    case 3:  // configuration item data[2], value data[3]
+      switch(data[2]) {
+      case 0:  // delay before settings are saved in 100ms, 0 = never
+	persist_delay = data[3];
+	if(!persist_delay)
+	  persist_timer = 0;
+	else if(persist_timer)
+	  persist_touch();
+	break;
+
+      case 1:  // save settings now
+	persist_timer = 0;
+	persist_pending = 1;
+	break;
+
+      case 2:  // time instructions instead of reading the busy flag
+	lcd_set_timed(data[3]?1:0);
+	break;
+      }
+      break;
+
     default:
       // must not happen ...
       break;      
@@ -163,24 +1124,107 @@ uchar	usbFunctionSetup(uchar data[8]) {
       break;
 
     case 1: // keys
-      replyBuf[0] = ((PINC & _BV(5))?0:1) | 
-	            ((PINB & _BV(0))?0:2);
+      replyBuf[0] = keys_read();
       replyBuf[1] = 0;
       return 2;
       break;
 
-    case 2: // controller map
+    case 2: // controller map, both are reported until they have been
+            // probed. The host is not kept waiting meanwhile
       replyBuf[0] = controller;
-      replyBuf[1] = 0;
+      replyBuf[1] = state_get();
       return 2;
       break;      
 
+    case 3: // capability descriptor
+      return caps_get();
+      break;
+
     default:
       // must not happen ...
       break;      
     }
     break;
 
+  case 5: // address command followed by up to three data bytes or,
+          // with R set, a RS bitmap followed by up to three bytes
+    target &= controller;  // mask installed controllers
+
+    if(target && (data[1] & 0x04)) {
+      for(i=1;i<len;i++)
+	queue_put(target | ((data[2] & _BV(i-1))?QUEUE_RS:0), data[2+i]);
+    } else if(target) {
+      queue_put(target, data[2]);
+
+      for(i=1;i<len;i++)
+	queue_put(target | QUEUE_RS, data[2+i]);
+    }
+    break;
+
+  case 6: // long transfer, data in data stage
+    long_target = target & controller;  // mask installed controllers
+    long_segment = 0;
+    long_ticker = long_macro = 0;
+    long_fb = data[1] & 0x04;
+    long_mixed = !long_fb && (data[2] & LONG_MIXED);
+    long_cell = data[2] % FB_SIZE;
+    long_room = long_fb?((long_target == (LCD_CTRL_0|LCD_CTRL_1))?32:16):8;
+    long_left = ((usbRequest_t*)data)->wLength.word;
+
+    // more than the driver can handle? Framebuffer cells are ignored
+    // without a framebuffer
+    if((((usbRequest_t*)data)->wLength.word > USB_NO_MSG - 1) ||
+       (!WITH_FB && long_fb))
+      long_left = 0;
+
+    if(long_left) {
+      // the setup packet has already been accepted at this point, so
+      // it's safe to refuse the first data packet until there's room
+      if(!queue_room())
+	usbDisableAllRequests();
+
+      return USB_NO_MSG;  // use usbFunctionWrite()
+    }
+    break;
+
+  case 7: // ticker: text in data stage, first cell in lsb of value,
+          // window width in msb of value, ms per step in index
+          // with R set: macro slot in lsb of value, operation in msb
+          // of value, offset or length in index
+    long_left = ((usbRequest_t*)data)->wLength.word;
+
+    if(((usbRequest_t*)data)->wLength.word > USB_NO_MSG - 1)
+      long_left = 0;
+
+    if(data[1] & 0x04) {
+      long_ticker = 0;
+#if WITH_MACROS
+      long_left = macro_request(target & controller, data[2], data[3], 
+				data[4] | (data[5] << 8), long_left);
+#else
+      long_macro = LONG_MACRO_STALL;  // no macros, the request is rejected
+#endif
+    } else {
+#if WITH_TICKER
+      long_ticker = 1;
+      long_macro = 0;
+      ticker_start(target & controller, data[2], data[3], 
+		   data[4] | (data[5] << 8));
+
+      if(long_left > TICKER_MAX)
+	long_left = 0;
+#else
+      long_left = 0;      // no ticker, the text is ignored
+#endif
+    }
+
+    if(long_left) {
+      long_fb = long_mixed = 0;
+      long_room = 0;                  // nothing is queued
+      return USB_NO_MSG;  // use usbFunctionWrite()
+    }
+    break;
+
   default:
     // must not happen ...
     break;
@@ -192,6 +1236,8 @@ uchar	usbFunctionSetup(uchar data[8]) {
 /* ------------------------------------------------------------------------- */
 
 int	main(void) {
+  uchar ms;
+
   wdt_enable(WDTO_1S);
 
   /* let debug routines init the uart if they want to */
@@ -210,30 +1256,31 @@ int	main(void) {
   usbInit();
 
   pwm_init();
+  clock_init();
 
   DDRC &= ~_BV(5);         /* input S1 */
   PORTC |= _BV(5);         /* with pullup */
   DDRB &= ~_BV(0);         /* input S2 */
   PORTB |= _BV(0);         /* with pullup */
 
-  /* try to init two controllers */
-  if(lcd_init(LCD_CTRL_0)) controller |= LCD_CTRL_0;
-  if(lcd_init(LCD_CTRL_1)) controller |= LCD_CTRL_1;
-
-  /* put string to display (line 1) with linefeed */
-  if(controller & LCD_CTRL_0)
-    lcd_puts(LCD_CTRL_0, "LCD2USB V" VERSION_STR);
-
-  if(controller & LCD_CTRL_1)
-    lcd_puts(LCD_CTRL_1, "2nd ctrl");
-
-  if((controller & LCD_CTRL_0) && (controller & LCD_CTRL_1))
-    lcd_puts(LCD_CTRL_0 | LCD_CTRL_1, " both!");
-
+  /* the displays are initialized from the main loop */
   sei();
   for(;;) {	/* main event loop */
     wdt_reset();
     usbPoll();
+    queue_poll();
+    ms = clock_poll();
+    init_poll(ms);
+    ticker_poll(ms);
+    keys_poll(ms);
+    fade_poll(ms);
+    persist_poll(ms);
+    macro_poll();
+
+    /* resume a long transfer paused by usbFunctionWrite() */
+    if(usbAllRequestsAreDisabled() && queue_room() && 
+       !(long_macro && macro_busy()))
+      usbEnableAllRequests();
   }
   return 0;
 }
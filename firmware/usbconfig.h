@@ -63,7 +63,7 @@ must be adapted to your hardware.
  * results in bigger code size.
  * If you have problems with long cables, try setting this value to 1.
  */
-#define USB_CFG_IMPLEMENT_FN_WRITE		0
+#define USB_CFG_IMPLEMENT_FN_WRITE		1
 /* Set this to 1 if you want usbFunctionWrite() to be called for control-out
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
@@ -74,6 +74,17 @@ must be adapted to your hardware.
  * data from a static buffer, set it to 0 and return the data from
  * usbFunctionSetup(). This saves a couple of bytes.
  */
+#define USB_CFG_HAVE_FLOWCONTROL		1
+/* Define this to 1 if you want flowcontrol over USB data. See the definition
+ * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
+ * usbdrv.h. Long transfers are paused this way while the command queue
+ * is full.
+ */
+#define USB_CFG_LONG_TRANSFERS			0
+/* Define this to 1 if you want to send/receive blocks of more than 254 bytes
+ * in a single control-in or control-out transfer. Note that the capability
+ * for long transfers increases the driver size.
+ */
 
 /* -------------------------- Device Description --------------------------- */
 
@@ -85,7 +96,7 @@ must be adapted to your hardware.
  * share the same product and vendor IDs. Not even if the devices are never
  * on the same bus together!
  */
-#define	USB_CFG_DEVICE_VERSION	0x09, 0x01
+#define	USB_CFG_DEVICE_VERSION	0x0b, 0x01
 /* Version number of the device: Minor number first, then major number.
  */
 #define	USB_CFG_VENDOR_NAME		'T', 'i', 'l', 'l', ' ', 'H', 'a', 'r', 'b', 'a', 'u', 'm'
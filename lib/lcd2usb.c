@@ -0,0 +1,2912 @@
+/*
+ * lcd2usb.c - library for the lcd2usb interface
+ *             http://www.harbaum.org/till/lcd2usb
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#ifdef WIN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "lcd2usb.h"
+
+#define LCD_ECHO           (0<<5)
+#define LCD_CMD            (1<<5)
+#define LCD_DATA           (2<<5)
+#define LCD_SET            (3<<5)
+#define LCD_GET            (4<<5)
+#define LCD_GOTO           (5<<5)   /* address command and data */
+#define LCD_MIXED          (LCD_GOTO | (1<<2))  /* rs bitmap and bytes */
+#define LCD_LONG           (6<<5)
+#define LCD_TICKER         (7<<5)   /* text scrolled by the device */
+#define LCD_MACRO          (LCD_TICKER | (1<<2))  /* eeprom macros */
+
+/* target is value to set */
+#define LCD_SET_CONTRAST   (LCD_SET | (0<<3))
+#define LCD_SET_BRIGHTNESS (LCD_SET | (1<<3))
+#define LCD_SET_FADE       (LCD_SET | (2<<3))
+#define LCD_SET_CONFIG     (LCD_SET | (3<<3))
+
+/* configuration items, the item is sent in the lsb of the value */
+/* and the setting in its msb */
+#define LCD_CONFIG_PERSIST 0   /* save delay in 100ms units, 0 = never */
+#define LCD_CONFIG_SAVE    1   /* save settings now */
+#define LCD_CONFIG_TIMED   2   /* 1 = timed writes, 0 = busy flag reads */
+
+/* target is value to get */
+#define LCD_GET_FWVER      (LCD_GET | (0<<3))
+#define LCD_GET_KEYS       (LCD_GET | (1<<3))
+#define LCD_GET_CTRL       (LCD_GET | (2<<3))
+#define LCD_GET_CAPS       (LCD_GET | (3<<3))
+
+/* key events are sent via the interrupt-in endpoint */
+#define LCD_KEY_EP         (LIBUSB_ENDPOINT_IN | 1)
+#define LCD_KEY_LOST       0x80
+
+#ifdef WIN
+#define MSLEEP(a) Sleep(a)
+typedef CRITICAL_SECTION lcd_mutex_t;
+#define MUTEX_INIT(m)    InitializeCriticalSection(m)
+#define MUTEX_DESTROY(m) DeleteCriticalSection(m)
+#define MUTEX_LOCK(m)    EnterCriticalSection(m)
+#define MUTEX_UNLOCK(m)  LeaveCriticalSection(m)
+#else
+#define MSLEEP(a) usleep(a*1000)
+typedef pthread_mutex_t lcd_mutex_t;
+#define MUTEX_INIT(m)    pthread_mutex_init(m, NULL)
+#define MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#define MUTEX_LOCK(m)    pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m)  pthread_mutex_unlock(m)
+#endif
+
+/* Output requests don't return anything, so there's no need to wait */
+/* for each of them to complete before the next one is issued. Up to */
+/* pipeline_depth control transfers are queued at the usb host */
+/* controller, which processes transfers to endpoint 0 in order. A */
+/* depth of 1 gives the traditional blocking behaviour */
+#define PIPELINE_MAX 64
+
+/* to increase performance, a little buffer is being used to */
+/* collect command bytes of the same type before transmitting them */
+#define BUFFER_MAX_CMD 4        /* current protocol supports up to 4 bytes */
+
+/* Firmware 1.10 and later also accepts long transfers. Their data */
+/* stage carries a stream of segments, each starting with a header */
+/* byte: bit 7 set for data, cleared for commands, bits 0..6 = number */
+/* of bytes - 1. All segments address the same controllers which are */
+/* given in the target bits of the request byte */
+#define LONG_MAX     254        /* max data stage of the avr usb driver */
+#define LONG_DATA    0x80       /* segment header: data follows */
+#define LONG_SEGMENT 128        /* max bytes per segment */
+
+/* Firmware 1.11 and later keeps a copy of the display contents. With */
+/* the R bit set the data stage of a long transfer carries cells which */
+/* are written to the display only if they differ from that copy. The */
+/* lsb of value gives the first cell (line * 40 + column) */
+#define LONG_FB      (1<<2)
+
+/* With bit 0 of value set the data stage of a long transfer consists */
+/* of groups of up to eight bytes instead of segments, each preceded */
+/* by a bitmap with bit n set if byte n of the group is data. This is */
+/* shorter if commands and data alternate often (firmware 1.11) */
+#define LONG_MIXED   0x01
+#define LONG_GROUP   8          /* bytes per group */
+
+/* Buffers of the shadow framebuffer are indexed in DDRAM layout: each */
+/* controller has two lines of 40 characters, line 0 at address 0x00 */
+/* and line 1 at address 0x40 */
+#define LCD_DDRAM_LINE   40
+#define LCD_DDRAM_SIZE   (2*LCD_DDRAM_LINE)
+
+/* The HD44780 has eight CGRAM slots for user defined 5x8 glyphs. */
+/* Glyphs drawn into the framebuffer are mapped onto these slots when */
+/* the frame is committed. A glyph is only uploaded if it's not */
+/* resident yet, the least recently used slot is replaced if needed */
+#define LCD_CGRAM_SLOTS  8
+#define LCD_GLYPHS       64     /* distinct glyphs in a frame */
+
+/* The display shift moves the visible window of both lines of a */
+/* controller through the DDRAM lines. The frame is drawn unshifted */
+/* and rotated into the current window when it's committed. Marquees */
+/* ask the commit to move the window one character further, which is */
+/* done if that's cheaper than rewriting the cells: the characters */
+/* already in DDRAM just move, only the ones entering the screen */
+/* have to be written */
+#define LCD_MARQUEES     4      /* one per row */
+#define LCD_MARQUEE_MAX  128
+
+/* Firmware 1.11 and later scrolls a ticker through a window of cells */
+/* of one controller by itself. Its text is sent in the data stage of */
+/* a request, value gives the first cell and the window width, index */
+/* the step interval in ms. The framebuffer leaves the window alone and */
+/* doesn't shift the display of that controller */
+#define LCD_TICKER_MAX   80
+
+/* Firmware 1.11 and later stores macros of up to 125 bytes of */
+/* segments in its eeprom. The slot is given in the lsb of value, */
+/* the operation in the msb. A macro is sent in parts, each holding */
+/* the device off for 8.5ms per changed byte, and completed by */
+/* setting its length */
+#define LCD_MACRO_PLAY   0      /* write macro to the display */
+#define LCD_MACRO_WRITE  1      /* store data stage at offset in index */
+#define LCD_MACRO_END    2      /* set the length to index */
+#define LCD_MACRO_MAX    125
+#define LCD_MACRO_PART   48     /* bytes stored within the timeout */
+#define LCD_MACRO_MS     5      /* polling interval while storing */
+#define LCD_MACRO_TRIES  400    /* a macro is stored within 1.1s */
+
+struct lcd_marquee {
+  int len;                      /* 0 = inactive */
+  int pos;                      /* text index shown in the first column */
+  char text[LCD_MARQUEE_MAX];
+};
+
+struct lcd_glyph {
+  unsigned long hash;
+  unsigned char data[8];        /* one byte per row, 5 bits used */
+};
+
+struct lcd_cgram {
+  int valid;                    /* slot contents are known */
+  struct lcd_glyph glyph;
+  unsigned long used;           /* commit the glyph was last used in */
+};
+
+/* Contexts driven by a manager don't wait for the device. Complete */
+/* transfers are kept in a per device queue instead until the */
+/* manager's event loop submits them */
+#define LCD_QUEUE 16
+
+struct lcd_xfer {
+  int request, value, index, len;
+  unsigned char data[LONG_MAX];
+};
+
+struct lcd2usb {
+  lcd_mutex_t lock;            /* serializes api calls */
+  lcd_mutex_t pipe_lock;       /* pipeline state, also used by callbacks */
+
+  libusb_context       *usb_ctx;
+  libusb_device_handle *handle;
+  int claimed;                 /* interface claimed for key events */
+
+#ifndef WIN
+  /* Instead of a real device the host compiled firmware in firmware/emu */
+  /* may be used. It's started as a child process and connected through */
+  /* a socket. See firmware/emu/usbdrv.h for the protocol */
+  int emu_fd;
+  pid_t emu_pid;
+  int emu_latency;                            /* simulated round trip in us */
+  struct timeval emu_submitted[PIPELINE_MAX]; /* submission time of transfers */
+  unsigned char emu_status[PIPELINE_MAX];     /* status of received replies */
+  unsigned long emu_received;                 /* replies received */
+#endif
+
+  struct lcd2usb_info info;
+  struct lcd2usb_manager *mgr; /* manager driving this context */
+
+  /* transfers not yet submitted, managed contexts only */
+  struct lcd_xfer queue[LCD_QUEUE];
+  unsigned int queue_head, queue_tail;
+
+  int version;                 /* firmware version, -1 = unknown */
+  struct lcd2usb_caps caps;    /* as read by lcd_setup() */
+
+  /* transfer pipeline */
+  int pipeline_depth;
+  int pipeline_pending;        /* transfers submitted but not completed */
+  int pipeline_error;          /* a transfer has failed */
+  unsigned long pipeline_submitted, pipeline_completed;
+
+  /* short transfers */
+  int queue_free;              /* device queue entries known to be free */
+  int goto_enabled;            /* commands and data may be mixed */
+  int buffer_current_type;     /* -1 = nothing in buffer yet */
+  int buffer_current_fill;
+  unsigned char buffer[BUFFER_MAX_CMD];
+
+  /* long transfers */
+  int long_enabled;            /* device supports long transfers */
+  int long_max;                /* max bytes per long transfer */
+  int long_target;             /* controllers addressed */
+  int long_fill;               /* bytes in long_buffer */
+  int long_header;             /* position of current segment header */
+  int long_count;              /* bytes in current segment */
+  int long_bytes;              /* bytes without segment headers */
+  /* segments may take more than long_max bytes as long as they */
+  /* fit if sent as groups */
+  unsigned char long_buffer[2*LONG_MAX];
+
+  /* shadow framebuffer */
+  int fb_ctrl;                                  /* installed controllers */
+  int fb_rows, fb_cols;                         /* display geometry */
+  unsigned char fb_frame[2][LCD_DDRAM_SIZE];    /* frame being drawn */
+  short fb_shadow[2][LCD_DDRAM_SIZE];           /* display contents, -1 = unknown */
+  int fb_ac[2];                                 /* address counter, -1 = unknown */
+  unsigned char fb_visible[2][LCD_DDRAM_SIZE];  /* cell is shown on screen */
+  struct lcd_glyph fb_glyph[LCD_GLYPHS];        /* glyphs drawn */
+  int fb_glyphs;
+  signed char fb_cell[2][LCD_DDRAM_SIZE];       /* glyph of cell, -1 = none */
+  int fb_shift[2];                              /* display shift, -1 = unknown */
+  int fb_scroll[2];                             /* shift wanted by next commit */
+  struct lcd_marquee marquee[LCD_MARQUEES];
+  int ticker_c;                                 /* controller of the ticker */
+  int ticker_cell, ticker_width;                /* its window, 0 = none */
+
+  /* glyph cache */
+  struct lcd_cgram cgram[LCD_CGRAM_SLOTS];
+  unsigned long cgram_tick;
+
+  struct lcd2usb_stats stats;
+};
+
+/* ------------------------- emulated device --------------------------- */
+
+#ifndef WIN
+static int lcd_emu_open(lcd2usb_t *lcd, const char *cmd) {
+  int sv[2];
+  pid_t pid;
+
+  /* a terminating emulator must not kill the host process */
+  signal(SIGPIPE, SIG_IGN);
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+
+  /* emulators started later must not inherit this connection, */
+  /* otherwise closing it wouldn't terminate this emulator */
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+  if((pid = fork()) < 0) {
+    perror("fork");
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+
+  /* the emulator talks to the host through its stdin */
+  if(!pid) {
+    close(sv[0]);
+    dup2(sv[1], 0);
+    close(sv[1]);
+    execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+    _exit(127);
+  }
+
+  close(sv[1]);
+  lcd->emu_fd = sv[0];
+  lcd->emu_pid = pid;
+  return 0;
+}
+
+static int lcd_emu_io(lcd2usb_t *lcd, int write_io, void *buf, int len) {
+  unsigned char *p = buf;
+  int n;
+
+  while(len) {
+    n = write_io?write(lcd->emu_fd, p, len):read(lcd->emu_fd, p, len);
+    if(n <= 0) {
+      fprintf(stderr, "Emulator connection failed!");
+      return -1;
+    }
+
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* send a setup packet and the data of a control-out transfer */
+static int lcd_emu_submit(lcd2usb_t *lcd, int type, int request, int value,
+			  int index, unsigned char *data, int len) {
+  unsigned char setup[8];
+
+  libusb_fill_control_setup(setup, type, request, value, index, len);
+
+  gettimeofday(&lcd->emu_submitted[lcd->pipeline_submitted % PIPELINE_MAX],
+	       NULL);
+
+  if(lcd_emu_io(lcd, 1, setup, sizeof(setup)) < 0)
+    return -1;
+
+  if(!(type & LIBUSB_ENDPOINT_IN) && len)
+    return lcd_emu_io(lcd, 1, data, len);
+
+  return 0;
+}
+
+/* a real bus doesn't answer this fast: time in us until the reply */
+/* to transfer seq is due */
+static long lcd_emu_due(lcd2usb_t *lcd, unsigned long seq) {
+  struct timeval now, *sub = &lcd->emu_submitted[seq % PIPELINE_MAX];
+
+  gettimeofday(&now, NULL);
+  return lcd->emu_latency -
+    ((now.tv_sec - sub->tv_sec)*1000000 + now.tv_usec - sub->tv_usec);
+}
+
+/* receive the reply to a transfer, returns number of bytes */
+/* received or -1 if the emulated device stalled the transfer */
+static int lcd_emu_reply(lcd2usb_t *lcd, unsigned long seq,
+			 unsigned char *data, int len) {
+  unsigned char hdr[3], dummy;
+  int rlen, i;
+  long us;
+
+  if(lcd_emu_io(lcd, 0, hdr, sizeof(hdr)) < 0)
+    return -1;
+
+  rlen = hdr[1] | (hdr[2] << 8);
+  for(i=0;i<rlen;i++)
+    if(lcd_emu_io(lcd, 0, (i < len)?data+i:&dummy, 1) < 0)
+      return -1;
+
+  if((us = lcd_emu_due(lcd, seq)) > 0)
+    usleep(us);
+
+  return hdr[0]?-1:((rlen < len)?rlen:len);
+}
+
+/* read the reply to the oldest output transfer not answered yet. */
+/* It only completes once its simulated round trip time has passed */
+static void lcd_emu_receive(lcd2usb_t *lcd) {
+  unsigned char hdr[3];
+
+  if(lcd_emu_io(lcd, 0, hdr, sizeof(hdr)) < 0)
+    hdr[0] = 1;
+
+  lcd->emu_status[lcd->emu_received++ % PIPELINE_MAX] = hdr[0];
+}
+#endif
+
+/* ----------------------- transfer pipeline --------------------------- */
+
+/* a queued transfer has completed */
+static void lcd_pipeline_complete(lcd2usb_t *lcd, unsigned long seq, int ok) {
+  MUTEX_LOCK(&lcd->pipe_lock);
+
+  if(!ok) {
+    fprintf(stderr, "USB request failed!");
+    lcd->pipeline_error = 1;
+  }
+
+  /* transfers must complete in the order they have been submitted */
+  if(seq != lcd->pipeline_completed) {
+    fprintf(stderr, "USB request completed out of order!");
+    lcd->pipeline_error = 1;
+  }
+
+  lcd->pipeline_completed = seq + 1;
+  lcd->pipeline_pending--;
+
+  MUTEX_UNLOCK(&lcd->pipe_lock);
+}
+
+/* the transfer keeps its context and sequence number in a little */
+/* structure appended to the setup packet and data */
+struct lcd_transfer_info {
+  lcd2usb_t *lcd;
+  unsigned long seq;
+};
+
+/* libusb completion callback, may run in any thread handling */
+/* events for this context */
+static void LIBUSB_CALL lcd_pipeline_done(struct libusb_transfer *transfer) {
+  struct lcd_transfer_info *info = transfer->user_data;
+
+  lcd_pipeline_complete(info->lcd, info->seq,
+		transfer->status == LIBUSB_TRANSFER_COMPLETED);
+}
+
+static int lcd_pipeline_pending(lcd2usb_t *lcd) {
+  int pending;
+
+  MUTEX_LOCK(&lcd->pipe_lock);
+  pending = lcd->pipeline_pending;
+  MUTEX_UNLOCK(&lcd->pipe_lock);
+
+  return pending;
+}
+
+/* process completions, blocks until at least one event has happened */
+static int lcd_pipeline_events(lcd2usb_t *lcd) {
+  int ret;
+
+#ifndef WIN
+  /* the emulator answers all transfers in order */
+  if(lcd->emu_fd >= 0) {
+    unsigned long seq = lcd->pipeline_completed;
+    long us;
+
+    if(!lcd->pipeline_pending)
+      return 0;
+
+    /* the manager may have received the reply already */
+    if(lcd->emu_received == seq)
+      lcd_emu_receive(lcd);
+
+    if((us = lcd_emu_due(lcd, seq)) > 0)
+      usleep(us);
+
+    lcd_pipeline_complete(lcd, seq, !lcd->emu_status[seq % PIPELINE_MAX]);
+    return 0;
+  }
+#endif
+
+  ret = libusb_handle_events(lcd->usb_ctx);
+
+  if(ret < 0) {
+    fprintf(stderr, "USB event handling failed: %s\n", libusb_error_name(ret));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int lcd_queue_submit(lcd2usb_t *lcd);
+
+/* wait for all queued transfers to complete, returns -1 if any of */
+/* them failed */
+static int lcd_pipeline_drain(lcd2usb_t *lcd) {
+  int ret = 0;
+
+  while(lcd->queue_head != lcd->queue_tail)
+    if(lcd_queue_submit(lcd) < 0)
+      return -1;
+
+  while(lcd_pipeline_pending(lcd))
+    if(lcd_pipeline_events(lcd) < 0)
+      return -1;
+
+  MUTEX_LOCK(&lcd->pipe_lock);
+  if(lcd->pipeline_error)
+    ret = -1;
+
+  lcd->pipeline_error = 0;
+  MUTEX_UNLOCK(&lcd->pipe_lock);
+
+  return ret;
+}
+
+/* queue a vendor request and the data of its data stage at libusb */
+static int lcd_usb_submit(lcd2usb_t *lcd, int request, int value, int index,
+			  unsigned char *data, int len) {
+  struct libusb_transfer *transfer;
+  struct lcd_transfer_info *info;
+  unsigned char *setup;
+  int ret;
+
+  transfer = libusb_alloc_transfer(0);
+  setup = malloc(LIBUSB_CONTROL_SETUP_SIZE + len + sizeof(*info));
+  if(!transfer || !setup) {
+    fprintf(stderr, "Out of memory!");
+    libusb_free_transfer(transfer);
+    free(setup);
+    return -1;
+  }
+
+  info = (struct lcd_transfer_info*)(setup + LIBUSB_CONTROL_SETUP_SIZE + len);
+  info->lcd = lcd;
+  info->seq = lcd->pipeline_submitted;
+
+  libusb_fill_control_setup(setup,
+	    LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+	    LIBUSB_ENDPOINT_OUT, request, value, index, len);
+  if(len)
+    memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+  libusb_fill_control_transfer(transfer, lcd->handle, setup,
+	    lcd_pipeline_done, info, 1000);
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+  if((ret = libusb_submit_transfer(transfer)) < 0) {
+    fprintf(stderr, "USB request failed: %s\n", libusb_error_name(ret));
+    libusb_free_transfer(transfer);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* submit a request, waits for a free slot in the pipeline */
+static int lcd_submit(lcd2usb_t *lcd, int request, int value, int index,
+		      unsigned char *data, int len) {
+  int ret;
+
+  /* wait for a free slot */
+  while(lcd_pipeline_pending(lcd) >= lcd->pipeline_depth)
+    if(lcd_pipeline_events(lcd) < 0)
+      return -1;
+
+  /* account for the transfer first, its callback may run in */
+  /* another thread before libusb_submit_transfer() returns */
+  MUTEX_LOCK(&lcd->pipe_lock);
+  lcd->pipeline_pending++;
+  MUTEX_UNLOCK(&lcd->pipe_lock);
+
+#ifndef WIN
+  if(lcd->emu_fd >= 0)
+    ret = lcd_emu_submit(lcd, LIBUSB_REQUEST_TYPE_VENDOR |
+			 LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+			 request, value, index, data, len);
+  else
+#endif
+    ret = lcd_usb_submit(lcd, request, value, index, data, len);
+
+  if(ret < 0) {
+    MUTEX_LOCK(&lcd->pipe_lock);
+    lcd->pipeline_pending--;
+    MUTEX_UNLOCK(&lcd->pipe_lock);
+    return -1;
+  }
+
+  lcd->pipeline_submitted++;
+  return 0;
+}
+
+/* submit the oldest transfer of a managed context */
+static int lcd_queue_submit(lcd2usb_t *lcd) {
+  struct lcd_xfer *x = &lcd->queue[lcd->queue_tail % LCD_QUEUE];
+
+  if(lcd_submit(lcd, x->request, x->value, x->index, x->data, x->len) < 0)
+    return -1;
+
+  lcd->queue_tail++;
+  return 0;
+}
+
+/* send a request with len bytes of data in its data stage */
+static int lcd_send_data(lcd2usb_t *lcd, int request, int value, int index,
+			 unsigned char *data, int len) {
+  struct lcd_xfer *x;
+
+  lcd->stats.transfers++;
+
+  /* the manager submits the transfers of managed contexts. Only */
+  /* if the queue is full the caller has to wait for the device */
+  if(lcd->mgr) {
+    if((lcd->queue_head - lcd->queue_tail == LCD_QUEUE) &&
+       (lcd_queue_submit(lcd) < 0))
+      return -1;
+
+    x = &lcd->queue[lcd->queue_head++ % LCD_QUEUE];
+    x->request = request;
+    x->value = value;
+    x->index = index;
+    x->len = len;
+    if(len)
+      memcpy(x->data, data, len);
+
+    return 0;
+  }
+
+  if(lcd_submit(lcd, request, value, index, data, len) < 0)
+    return -1;
+
+  /* blocking mode: wait for request to complete */
+  if(lcd->pipeline_depth == 1)
+    return lcd_pipeline_drain(lcd);
+
+  return 0;
+}
+
+static int lcd_send(lcd2usb_t *lcd, int request, int value, int index) {
+  return lcd_send_data(lcd, request, value, index, NULL, 0);
+}
+
+/* synchronous control-in transfer, returns number of bytes received */
+static int lcd_control_in(lcd2usb_t *lcd, int request, int value,
+			  unsigned char *data, int len) {
+
+  /* all pending output has to be done before */
+  lcd_pipeline_drain(lcd);
+
+#ifndef WIN
+  if(lcd->emu_fd >= 0) {
+    if(lcd_emu_submit(lcd, LIBUSB_REQUEST_TYPE_VENDOR |
+		      LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN,
+		      request, value, 0, data, len) < 0)
+      return -1;
+
+    return lcd_emu_reply(lcd, lcd->pipeline_submitted, data, len);
+  }
+#endif
+
+  return libusb_control_transfer(lcd->handle,
+	   LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+	   LIBUSB_ENDPOINT_IN, request, value, 0, data, len, 1000);
+}
+
+/* ---------------------------- encoder -------------------------------- */
+
+/* command format:
+ * 7 6 5 4 3 2 1 0
+ * C C C T T R L L
+ *
+ * TT = target bit map
+ * R = reserved for future use, set to 0
+ * LL = number of bytes in transfer - 1
+ */
+
+/* Since firmware 1.11 a request of type 5 carries an address command */
+/* followed by up to three data bytes, so positioning the cursor and */
+/* writing a few characters doesn't need two transfers anymore. With */
+/* the R bit set the first byte is a bitmap with bit n set if byte */
+/* n + 1 is data instead, so commands and data may be mixed freely */
+
+/* a long transfer with no more than what fits into a short one is */
+/* sent without a data stage. Returns 1 if the request has been built */
+static int lcd_long_short(lcd2usb_t *lcd) {
+  unsigned char *b = lcd->long_buffer;
+  int n = (b[0] & ~LONG_DATA) + 1, type, i, j, k;
+
+  if ((lcd->long_fill == 1 + n) && (n <= BUFFER_MAX_CMD))
+    type = (b[0] & LONG_DATA)?LCD_DATA:LCD_CMD;
+  else if (lcd->goto_enabled && (n == 1) && !(b[0] & LONG_DATA) &&
+	   (b[1] & 0xc0) && (lcd->long_fill > 3) && (b[2] & LONG_DATA) &&
+	   (lcd->long_fill == 3 + (b[2] & ~LONG_DATA) + 1) &&
+	   (lcd->long_fill <= 3 + BUFFER_MAX_CMD - 1)) {
+    /* address command segment and data segment */
+    type = LCD_GOTO;
+    memmove(b + 2, b + 3, lcd->long_fill - 3);
+    n = lcd->long_fill - 2;
+  } else if (lcd->goto_enabled && (lcd->long_bytes < BUFFER_MAX_CMD)) {
+    /* a few commands and data bytes behind a rs bitmap */
+    lcd->buffer[0] = 0;
+    for (i = 0, k = 1; i < lcd->long_fill; i += n + 1) {
+      n = (b[i] & ~LONG_DATA) + 1;
+      for (j = 0; j < n; j++, k++) {
+	if (b[i] & LONG_DATA)
+	  lcd->buffer[0] |= 1 << (k - 1);
+	lcd->buffer[k] = b[i + 1 + j];
+      }
+    }
+    lcd->buffer_current_type = LCD_MIXED | lcd->long_target;
+    lcd->buffer_current_fill = k;
+    return 1;
+  } else
+    return 0;
+
+  memcpy(lcd->buffer, b + 1, n);
+  lcd->buffer_current_type = type | lcd->long_target;
+  lcd->buffer_current_fill = n;
+  return 1;
+}
+
+/* size of the data stage if the given number of bytes and segments */
+/* is added, sent as segments or as groups, whatever is shorter */
+static int lcd_long_size(lcd2usb_t *lcd, int bytes, int segments) {
+  int seg = lcd->long_fill + bytes + segments;
+  int mix = lcd->long_bytes + bytes +
+    (lcd->long_bytes + bytes + LONG_GROUP - 1) / LONG_GROUP;
+
+  return (lcd->goto_enabled && (mix < seg))?mix:seg;
+}
+
+/* re-encode the segments in the long buffer as groups if that's */
+/* shorter. Returns the value for the request */
+static int lcd_long_mixed(lcd2usb_t *lcd, unsigned char *out, int *len) {
+  unsigned char *b = lcd->long_buffer;
+  int i, j, n, k = 0, group = 0;
+
+  if (lcd_long_size(lcd, 0, 0) == lcd->long_fill) {
+    memcpy(out, b, lcd->long_fill);
+    *len = lcd->long_fill;
+    return 0;
+  }
+
+  for (i = 0; i < lcd->long_fill; i += n + 1) {
+    n = (b[i] & ~LONG_DATA) + 1;
+    for (j = 0; j < n; j++) {
+      /* start a new group with an empty bitmap */
+      if (!(k % (LONG_GROUP + 1))) {
+	group = k++;
+	out[group] = 0;
+      }
+
+      if (b[i] & LONG_DATA)
+	out[group] |= 1 << (k - group - 1);
+      out[k++] = b[i + 1 + j];
+    }
+  }
+
+  *len = k;
+  return LONG_MIXED;
+}
+
+static void lcd_fb_invalidate(lcd2usb_t *lcd);
+
+/* The device queues the commands and data of short requests without */
+/* flow control, entries that don't fit are dropped and counted. So */
+/* before more entries are sent than are known to be free, the queue */
+/* state is read and the device is given some time to write out what */
+/* it has queued. Dropped entries leave the display contents unknown */
+#define LCD_QUEUE_TRIES    100
+#define LCD_QUEUE_MS       1
+
+/* entries fit without asking, managed contexts can't wait for a reply */
+static int lcd_queue_fits(lcd2usb_t *lcd, int entries) {
+  return !(lcd->caps.features & LCD2USB_FEATURE_QUEUE_STATE) || lcd->mgr ||
+    (lcd->queue_free >= entries);
+}
+
+static int lcd_queue_reserve(lcd2usb_t *lcd, int entries) {
+  unsigned char buffer[2];
+  int ret = 0, tries = 0;
+
+  while(!lcd_queue_fits(lcd, entries)) {
+    if(lcd_control_in(lcd, LCD_CMD, 0, buffer, sizeof(buffer)) != 
+       sizeof(buffer))
+      return -1;
+
+    if(buffer[1]) {
+      lcd->stats.queue_overflows += buffer[1];
+      lcd_fb_invalidate(lcd);
+      ret = -1;
+    }
+
+    /* a step of the device's ticker needs up to two entries per cell */
+    lcd->queue_free = buffer[0];
+    if(lcd->ticker_width)
+      lcd->queue_free -= 2 * lcd->ticker_width + 1;
+
+    /* an empty queue takes what's sent anyway */
+    if((buffer[0] >= lcd->caps.queue) || (tries++ == LCD_QUEUE_TRIES))
+      break;
+
+    if(!lcd_queue_fits(lcd, entries))
+      MSLEEP(LCD_QUEUE_MS);
+  }
+
+  lcd->queue_free -= entries;
+  return ret;
+}
+
+/* flush command queue due to buffer overflow / content */
+/* change or due to explicit request */
+static int lcd_flush(lcd2usb_t *lcd) {
+  unsigned char data[LONG_MAX];
+  int request, value, index, ret, len;
+
+  /* long transfers are flow controlled, what's left in the long */
+  /* buffer is only sent as short request if the queue has room */
+  if (lcd->long_fill && lcd_queue_fits(lcd, lcd->long_bytes) &&
+      lcd_long_short(lcd)) {
+    lcd->long_target = -1;
+    lcd->long_fill = 0;
+    lcd->long_bytes = 0;
+    lcd->long_header = -1;
+  }
+
+  if (lcd->long_fill) {
+    value = lcd_long_mixed(lcd, data, &len);
+    ret = lcd_send_data(lcd, LCD_LONG | lcd->long_target, value, 0,
+			data, len);
+    lcd->queue_free -= lcd->long_bytes;
+
+    lcd->long_target = -1;
+    lcd->long_fill = 0;
+    lcd->long_bytes = 0;
+    lcd->long_header = -1;
+    return ret;
+  }
+
+  /* anything to flush? ignore request if not */
+  if (lcd->buffer_current_type == -1)
+    return 0;
+
+  /* build request byte */
+  request = lcd->buffer_current_type | (lcd->buffer_current_fill - 1);
+
+  /* fill value and index with buffer contents. endianess should IMHO not */
+  /* be a problem, since libusb_fill_control_setup() will handle this. */
+  value = lcd->buffer[0] | (lcd->buffer[1] << 8);
+  index = lcd->buffer[2] | (lcd->buffer[3] << 8);
+
+  /* the rs bitmap doesn't take a queue entry */
+  ret = lcd_queue_reserve(lcd, lcd->buffer_current_fill -
+	  (((lcd->buffer_current_type & ~LCD2USB_BOTH) == LCD_MIXED)?1:0));
+
+  /* send current buffer contents */
+  ret |= lcd_send(lcd, request, value, index);
+
+  /* buffer is now free again */
+  lcd->buffer_current_type = -1;
+  lcd->buffer_current_fill = 0;
+  return ret;
+}
+
+/* append a byte to the long transfer buffer */
+static int lcd_long_enqueue(lcd2usb_t *lcd, int command_type, int value) {
+  int target = command_type & LCD2USB_BOTH;
+  int rs = ((command_type & ~LCD2USB_BOTH) == LCD_DATA)?LONG_DATA:0;
+  int ret = 0, segment;
+
+  if (lcd->long_fill && (lcd->long_target != target))
+    ret = lcd_flush(lcd);
+
+  /* start a new segment if the type changes or the current one is full */
+  segment = (lcd->long_header < 0) ||
+    ((lcd->long_buffer[lcd->long_header] & LONG_DATA) != rs) ||
+    (lcd->long_count == LONG_SEGMENT);
+
+  /* the byte and maybe a header must fit */
+  if (lcd->long_fill && (lcd_long_size(lcd, 1, segment) > lcd->long_max)) {
+    ret |= lcd_flush(lcd);
+    segment = 1;
+  }
+
+  if (segment) {
+    lcd->long_header = lcd->long_fill++;
+    lcd->long_count = 0;
+  }
+
+  lcd->long_target = target;
+  lcd->long_buffer[lcd->long_fill++] = value;
+  lcd->long_buffer[lcd->long_header] = rs | lcd->long_count++;
+  lcd->long_bytes++;
+
+  if (lcd_long_size(lcd, 1, 0) > lcd->long_max)
+    ret |= lcd_flush(lcd);
+
+  return ret;
+}
+
+/* enqueue a command into the buffer */
+static int lcd_enqueue(lcd2usb_t *lcd, int command_type, int value) {
+  int ctrl = command_type & LCD2USB_BOTH;
+  int type = command_type & ~LCD2USB_BOTH;
+  int ret = 0, addr, cur, n;
+
+  if (lcd->long_enabled)
+    return lcd_long_enqueue(lcd, command_type, value);
+
+  /* data following an address command is sent along with it */
+  if (lcd->goto_enabled && (command_type == (LCD_DATA | ctrl)) &&
+      (lcd->buffer_current_type == (LCD_CMD | ctrl)) &&
+      (lcd->buffer[lcd->buffer_current_fill-1] & 0xc0)) {
+    addr = lcd->buffer[--lcd->buffer_current_fill];
+    if (lcd->buffer_current_fill)
+      ret = lcd_flush(lcd);
+
+    lcd->buffer_current_type = LCD_GOTO | ctrl;
+    lcd->buffer[0] = addr;
+    lcd->buffer_current_fill = 1;
+  }
+
+  /* other changes between commands and data don't flush the buffer */
+  /* but turn it into a mixed one if there's room for the rs bitmap. */
+  /* Address commands rather start a new buffer which the following */
+  /* data can join */
+  cur = lcd->buffer_current_type & ~LCD2USB_BOTH;
+  n = lcd->buffer_current_fill;
+  if (lcd->goto_enabled && (lcd->buffer_current_type >= 0) &&
+      ((lcd->buffer_current_type & LCD2USB_BOTH) == ctrl) &&
+      ((type == LCD_CMD) || (type == LCD_DATA)) &&
+      (cur != type) && (cur != LCD_MIXED) && (n < BUFFER_MAX_CMD - 1) &&
+      !((cur == LCD_GOTO) && (type == LCD_DATA)) &&
+      !((type == LCD_CMD) && (value & 0xc0))) {
+    memmove(lcd->buffer + 1, lcd->buffer, n);
+    lcd->buffer[0] = (cur == LCD_CMD)?0:(1 << n) - ((cur == LCD_GOTO)?2:1);
+    lcd->buffer_current_type = LCD_MIXED | ctrl;
+    lcd->buffer_current_fill++;
+    cur = LCD_MIXED;
+  }
+
+  if ((cur == LCD_MIXED) && ((type == LCD_CMD) || (type == LCD_DATA)) &&
+      (lcd->buffer_current_type == (LCD_MIXED | ctrl))) {
+    if (type == LCD_DATA)
+      lcd->buffer[0] |= 1 << (lcd->buffer_current_fill - 1);
+    command_type = LCD_MIXED | ctrl;
+  }
+
+  if ((lcd->buffer_current_type == (LCD_GOTO | ctrl)) &&
+      (command_type == (LCD_DATA | ctrl)))
+    command_type = LCD_GOTO | ctrl;
+
+  if ((lcd->buffer_current_type >= 0) &&
+      (lcd->buffer_current_type != command_type))
+    ret = lcd_flush(lcd);
+
+  /* add new item to buffer */
+  lcd->buffer_current_type = command_type;
+  lcd->buffer[lcd->buffer_current_fill++] = value;
+
+  /* flush buffer if it's full */
+  if (lcd->buffer_current_fill == BUFFER_MAX_CMD)
+    ret |= lcd_flush(lcd);
+
+  return ret;
+}
+
+/* see HD44780 datasheet for a command description */
+static int lcd_command(lcd2usb_t *lcd, int ctrl, int cmd) {
+  return lcd_enqueue(lcd, LCD_CMD | ctrl, cmd);
+}
+
+/* --------------------- shadow framebuffer ---------------------- */
+
+/* convert a ddram buffer index into a ddram address */
+#define FB_ADDR(i)   (((i) / LCD_DDRAM_LINE) * 0x40 + (i) % LCD_DDRAM_LINE)
+
+/* map a screen position onto a controller and a ddram buffer index */
+/* dual controller displays use one controller per two lines, single */
+/* controller four line displays continue line 0 and 1 in lines 2 and 3 */
+static int lcd_fb_locate(lcd2usb_t *lcd, int row, int col, int *c) {
+  if(lcd->fb_ctrl == 3) {
+    *c = row / 2;
+    return (row & 1) * LCD_DDRAM_LINE + col;
+  }
+
+  *c = 0;
+  return (row & 1) * LCD_DDRAM_LINE + (row / 2) * lcd->fb_cols + col;
+}
+
+/* forget everything known about the display contents */
+static void lcd_fb_invalidate(lcd2usb_t *lcd) {
+  int c, i;
+
+  for(c=0;c<2;c++) {
+    for(i=0;i<LCD_DDRAM_SIZE;i++)
+      lcd->fb_shadow[c][i] = -1;
+
+    lcd->fb_ac[c] = -1;
+  }
+}
+
+/* the display has been cleared: all cells are blank and the */
+/* address counters are at home position */
+static void lcd_fb_blank(lcd2usb_t *lcd) {
+  int c, i;
+
+  for(c=0;c<2;c++) {
+    for(i=0;i<LCD_DDRAM_SIZE;i++)
+      lcd->fb_shadow[c][i] = ' ';
+
+    lcd->fb_ac[c] = 0;
+    lcd->fb_shift[c] = 0;
+  }
+}
+
+/* rotate the unshifted frame of a controller and its visible cells */
+/* into ddram layout as seen with the given display shift */
+static void lcd_fb_render(lcd2usb_t *lcd, int c, int shift,
+			  unsigned char *frame, unsigned char *visible) {
+  int i, j;
+
+  for(i=0;i<LCD_DDRAM_SIZE;i++) {
+    j = (i / LCD_DDRAM_LINE) * LCD_DDRAM_LINE +
+      (i % LCD_DDRAM_LINE + shift) % LCD_DDRAM_LINE;
+    frame[j] = lcd->fb_frame[c][i];
+    visible[j] = lcd->fb_visible[c][i];
+  }
+}
+
+/* number of shift commands needed to get from one shift to another, */
+/* negative if the display is to be shifted right */
+static int lcd_fb_shift_steps(int from, int to) {
+  int n = (to - from + LCD_DDRAM_LINE) % LCD_DDRAM_LINE;
+
+  return (n > LCD_DDRAM_LINE/2)?n - LCD_DDRAM_LINE:n;
+}
+
+/* move the visible window of the controllers in the bitmap, which */
+/* must have the same shift. Shifting the display left moves the */
+/* window towards higher addresses. Return home gets back to the */
+/* start in a single step */
+static int lcd_fb_shift(lcd2usb_t *lcd, int cmask, int shift) {
+  int ctrl = ((cmask & 1)?LCD2USB_CTRL_0:0) | ((cmask & 2)?LCD2USB_CTRL_1:0);
+  int c, n = lcd_fb_shift_steps(lcd->fb_shift[(cmask & 1)?0:1], shift);
+  int home = !shift && (abs(n) > 1);
+
+  if(home) {
+    if(lcd_command(lcd, ctrl, 0x03) < 0)
+      return -1;
+    n = 0;
+  }
+
+  while(n) {
+    if(lcd_command(lcd, ctrl, (n > 0)?0x18:0x1c) < 0)
+      return -1;
+
+    n += (n > 0)?-1:1;
+  }
+
+  for(c=0;c<2;c++) {
+    if(!(cmask & (1<<c)))
+      continue;
+
+    lcd->fb_shift[c] = shift;
+    if(home)
+      lcd->fb_ac[c] = 0;
+  }
+
+  return 0;
+}
+
+/* number of cells of a ddram line that are on screen */
+static int lcd_fb_width(lcd2usb_t *lcd) {
+  return ((lcd->fb_ctrl == 3) || (lcd->fb_rows <= 2))?
+    lcd->fb_cols:2*lcd->fb_cols;
+}
+
+/* display shift of the page hidden behind the visible one. The home */
+/* position is preferred since return home flips to it at once */
+static int lcd_fb_hidden(lcd2usb_t *lcd, int c) {
+  int w = lcd_fb_width(lcd), cur = lcd->fb_shift[c];
+
+  if((cur >= w) && ((LCD_DDRAM_LINE - cur) % LCD_DDRAM_LINE >= w))
+    return 0;
+
+  return (cur + LCD_DDRAM_LINE - w) % LCD_DDRAM_LINE;
+}
+
+/* the address counter wraps from the end of line 0 to line 1 and */
+/* from the end of line 1 back to line 0 */
+static int lcd_fb_next(int i) {
+  return (i + 1) % LCD_DDRAM_SIZE;
+}
+
+/* the cell is written by the device's ticker */
+static int lcd_fb_ticker(lcd2usb_t *lcd, int c, int i) {
+  return lcd->ticker_width && (c == lcd->ticker_c) &&
+    ((i - lcd->ticker_cell + LCD_DDRAM_SIZE) % LCD_DDRAM_SIZE <
+     lcd->ticker_width);
+}
+
+/* --------------------- glyph cache ------------------------ */
+
+/* glyphs are identified by their contents */
+static unsigned long lcd_glyph_hash(const unsigned char *data) {
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  for(i=0;i<8;i++)
+    hash = ((hash ^ (data[i] & 0x1f)) * 16777619UL) & 0xffffffffUL;
+
+  return hash;
+}
+
+static int lcd_glyph_equal(struct lcd_glyph *a, struct lcd_glyph *b) {
+  return (a->hash == b->hash) && !memcmp(a->data, b->data, sizeof(a->data));
+}
+
+/* forget the cgram contents */
+static void lcd_glyph_invalidate(lcd2usb_t *lcd) {
+  int s;
+
+  for(s=0;s<LCD_CGRAM_SLOTS;s++)
+    lcd->cgram[s].valid = 0;
+}
+
+/* remove glyphs not drawn anymore from the frame's glyph table */
+static void lcd_fb_glyph_compact(lcd2usb_t *lcd) {
+  signed char map[LCD_GLYPHS];
+  int c, i, g, n = 0;
+
+  memset(map, -1, sizeof(map));
+
+  for(c=0;c<2;c++)
+    for(i=0;i<LCD_DDRAM_SIZE;i++)
+      if(lcd->fb_cell[c][i] >= 0)
+	map[(int)lcd->fb_cell[c][i]] = 0;
+
+  for(g=0;g<lcd->fb_glyphs;g++)
+    if(!map[g]) {
+      lcd->fb_glyph[n] = lcd->fb_glyph[g];
+      map[g] = n++;
+    }
+
+  for(c=0;c<2;c++)
+    for(i=0;i<LCD_DDRAM_SIZE;i++)
+      if(lcd->fb_cell[c][i] >= 0)
+	lcd->fb_cell[c][i] = map[(int)lcd->fb_cell[c][i]];
+
+  lcd->fb_glyphs = n;
+}
+
+/* index of a glyph in the frame's glyph table, -1 if it's full */
+static int lcd_fb_glyph_find(lcd2usb_t *lcd, const unsigned char *data) {
+  struct lcd_glyph glyph;
+  int g;
+
+  for(g=0;g<8;g++)
+    glyph.data[g] = data[g] & 0x1f;
+  glyph.hash = lcd_glyph_hash(glyph.data);
+
+  for(g=0;g<lcd->fb_glyphs;g++)
+    if(lcd_glyph_equal(&lcd->fb_glyph[g], &glyph))
+      return g;
+
+  if(lcd->fb_glyphs == LCD_GLYPHS)
+    lcd_fb_glyph_compact(lcd);
+
+  if(lcd->fb_glyphs == LCD_GLYPHS)
+    return -1;
+
+  lcd->fb_glyph[lcd->fb_glyphs] = glyph;
+  return lcd->fb_glyphs++;
+}
+
+/* map the glyphs of the frame onto the cgram slots, upload those not */
+/* resident yet and store the slot numbers in the frame. Glyphs that */
+/* don't fit into the cgram anymore are shown as '?' */
+static int lcd_fb_glyph_resolve(lcd2usb_t *lcd) {
+  unsigned char used[LCD_GLYPHS];
+  signed char slot[LCD_GLYPHS];
+  int ctrl = ((lcd->fb_ctrl & 1)?LCD2USB_CTRL_0:0) |
+    ((lcd->fb_ctrl & 2)?LCD2USB_CTRL_1:0);
+  int c, i, g, s, lru, uploaded = 0;
+  unsigned long tick = ++lcd->cgram_tick;
+
+  /* glyphs on screen */
+  memset(used, 0, sizeof(used));
+  for(c=0;c<2;c++)
+    for(i=0;i<LCD_DDRAM_SIZE;i++)
+      if(lcd->fb_visible[c][i] && (lcd->fb_cell[c][i] >= 0))
+	used[(int)lcd->fb_cell[c][i]] = 1;
+
+  /* resident glyphs must not be replaced by the ones to be uploaded */
+  for(g=0;g<lcd->fb_glyphs;g++) {
+    slot[g] = -1;
+
+    if(!used[g])
+      continue;
+
+    for(s=0;s<LCD_CGRAM_SLOTS;s++)
+      if(lcd->cgram[s].valid &&
+	 lcd_glyph_equal(&lcd->cgram[s].glyph, &lcd->fb_glyph[g])) {
+	lcd->cgram[s].used = tick;
+	lcd->stats.glyph_hits++;
+	slot[g] = s;
+	break;
+      }
+  }
+
+  for(g=0;g<lcd->fb_glyphs;g++) {
+    if(!used[g] || (slot[g] >= 0))
+      continue;
+
+    /* use a free slot or the least recently used one */
+    for(lru=-1, s=0;s<LCD_CGRAM_SLOTS;s++) {
+      if(!lcd->cgram[s].valid) {
+	lru = s;
+	break;
+      }
+
+      if((lcd->cgram[s].used != tick) &&
+	 ((lru < 0) || (lcd->cgram[s].used < lcd->cgram[lru].used)))
+	lru = s;
+    }
+
+    if(lru < 0)
+      continue;
+
+    /* dual controller displays get the glyph at once */
+    if(lcd_command(lcd, ctrl, 0x40 | (lru << 3)) < 0)
+      return -1;
+
+    for(i=0;i<8;i++)
+      if(lcd_enqueue(lcd, LCD_DATA | ctrl, lcd->fb_glyph[g].data[i]) < 0)
+	return -1;
+
+    lcd->cgram[lru].valid = 1;
+    lcd->cgram[lru].glyph = lcd->fb_glyph[g];
+    lcd->cgram[lru].used = tick;
+    lcd->stats.glyph_misses++;
+    slot[g] = lru;
+    uploaded = 1;
+  }
+
+  /* the address counter now points into the cgram. Cells that showed */
+  /* a replaced glyph differ from the frame and are rewritten anyway */
+  if(uploaded) {
+    for(c=0;c<2;c++) {
+      if(!(lcd->fb_ctrl & (1<<c)))
+	continue;
+
+      if(lcd->fb_ac[c] < 0)
+	lcd->fb_ac[c] = 0;
+
+      if(lcd_command(lcd, c?LCD2USB_CTRL_1:LCD2USB_CTRL_0,
+		     0x80 | FB_ADDR(lcd->fb_ac[c])) < 0)
+	return -1;
+    }
+  }
+
+  for(c=0;c<2;c++)
+    for(i=0;i<LCD_DDRAM_SIZE;i++)
+      if(lcd->fb_cell[c][i] >= 0)
+	lcd->fb_frame[c][i] = (slot[(int)lcd->fb_cell[c][i]] >= 0)?
+	  slot[(int)lcd->fb_cell[c][i]]:'?';
+
+  return 0;
+}
+
+/* --------------------- update planner ------------------------ */
+
+/* lcd_enqueue() sends a packet whenever four bytes have been */
+/* collected or the request type changes. Thus every switch between */
+/* an address command and character data may cost an extra transfer. */
+/* The planner decides for each gap between two runs of changed cells */
+/* whether to jump over it using a "set DDRAM address" command or to */
+/* just rewrite the unchanged characters in between, so the address */
+/* counter auto increment keeps the data run unbroken */
+
+struct fb_run {
+  int start, len;
+};
+
+/* simulate the packet buffer of lcd_enqueue(): append n bytes of */
+/* type t and return the number of transfers this causes. With long */
+/* transfers a whole update usually fits into one transfer and the */
+/* number of bytes (including segment headers) is counted instead */
+static int lcd_plan_append(lcd2usb_t *lcd, int *type, int *fill, int t, int n) {
+  int cost = 0;
+
+  if(n <= 0)
+    return 0;
+
+  if(lcd->long_enabled) {
+    /* type change starts a new segment */
+    if(!*fill || (*type != t))
+      cost++;
+
+    *type = t;
+    *fill = 1;
+    return cost + n;
+  }
+
+  /* data following an address command shares its packet, the */
+  /* commands before it are sent on their own */
+  if(lcd->goto_enabled && *fill && (*type == LCD_CMD) && (t == LCD_DATA)) {
+    cost += (*fill > 1)?1:0;
+    *fill = 1;
+  } else if(*fill && (*type != t)) {
+    /* type change flushes buffer */
+    cost++;
+    *fill = 0;
+  }
+
+  *type = t;
+  *fill += n;
+  cost += *fill / BUFFER_MAX_CMD;
+  *fill %= BUFFER_MAX_CMD;
+
+  return cost;
+}
+
+/* distance from ddram index "from" to index "to" in auto increment */
+/* direction, -1 if "from" is unknown */
+static int lcd_plan_gap(int from, int to) {
+  if(from < 0)
+    return -1;
+
+  return (to - from + LCD_DDRAM_SIZE) % LCD_DDRAM_SIZE;
+}
+
+/* plan the update of a number of runs for controller c in the given */
+/* order. The address counter initially is at "ac". For every run "jump" */
+/* is set if an address command is to be sent, otherwise the gap is */
+/* rewritten if it doesn't cross the ticker. Returns the number of */
+/* transfers required. Since each run ends with data the state between */
+/* runs is just the buffer fill level and a small dynamic programming */
+/* over the four fill levels finds the cheapest combination */
+static int lcd_plan_runs(lcd2usb_t *lcd, int c, struct fb_run *run, int n,
+			 int ac, int allow_fill, unsigned char *jump) {
+  int cost[BUFFER_MAX_CMD], next[BUFFER_MAX_CMD];
+  unsigned char from[LCD_DDRAM_SIZE][BUFFER_MAX_CMD];
+  unsigned char opt[LCD_DDRAM_SIZE][BUFFER_MAX_CMD];
+  int i, k, f, o, t, nf, sum, gap, pos = ac, best;
+
+  /* initially the buffer is empty */
+  for(f=0;f<BUFFER_MAX_CMD;f++)
+    cost[f] = f?-1:0;
+
+  for(k=0;k<n;k++) {
+    gap = lcd_plan_gap(pos, run[k].start);
+
+    /* the ticker's cells must not be rewritten */
+    for(i=0;(gap > 0) && (i < gap);i++)
+      if(lcd_fb_ticker(lcd, c, (pos + i) % LCD_DDRAM_SIZE))
+	gap = -1;
+
+    for(f=0;f<BUFFER_MAX_CMD;f++)
+      next[f] = -1;
+
+    for(f=0;f<BUFFER_MAX_CMD;f++) {
+      if(cost[f] < 0)
+	continue;
+
+      /* option 0: rewrite gap, option 1: jump, prefer jumps on */
+      /* equal cost since they keep the device busy for less time */
+      for(o=0;o<2;o++) {
+	if(!o && (gap < 0 || (gap && !allow_fill)))
+	  continue;
+
+	t = LCD_DATA; nf = f;
+	sum = cost[f];
+	if(o)
+	  sum += lcd_plan_append(lcd, &t, &nf, LCD_CMD, 1);
+	sum += lcd_plan_append(lcd, &t, &nf, LCD_DATA, (o?0:gap) + run[k].len);
+
+	if(next[nf] < 0 || sum <= next[nf]) {
+	  next[nf] = sum;
+	  from[k][nf] = f;
+	  opt[k][nf] = o;
+	}
+      }
+    }
+
+    memcpy(cost, next, sizeof(cost));
+    pos = (run[k].start + run[k].len) % LCD_DDRAM_SIZE;
+  }
+
+  /* the final partially filled packet needs to be flushed */
+  best = -1;
+  for(f=0;f<BUFFER_MAX_CMD;f++) {
+    if(cost[f] < 0)
+      continue;
+
+    sum = cost[f] + (f?1:0);
+    if(best < 0 || sum < cost[best] + (best?1:0))
+      best = f;
+  }
+
+  if(best < 0)
+    return 0;
+
+  sum = cost[best] + (best?1:0);
+
+  /* walk back to collect the decisions */
+  for(k=n-1, f=best;k>=0;k--) {
+    jump[k] = opt[k][f];
+    f = from[k][f];
+  }
+
+  return sum;
+}
+
+/* the runs of changed cells of a rendered frame and the cheapest */
+/* way to write them */
+struct fb_plan {
+  int n, start, cost;
+  struct fb_run run[LCD_DDRAM_SIZE];
+  unsigned char jump[LCD_DDRAM_SIZE];
+};
+
+static void lcd_fb_plan(lcd2usb_t *lcd, int c, unsigned char *frame,
+			unsigned char *visible, struct fb_plan *plan) {
+  struct fb_run order[LCD_DDRAM_SIZE];
+  unsigned char jump[LCD_DDRAM_SIZE];
+  int i, k, s, n;
+
+  /* collect runs of changed visible cells */
+  for(n=0, i=0;i<LCD_DDRAM_SIZE;i++) {
+    if(!visible[i] || lcd->fb_shadow[c][i] == frame[i] ||
+       lcd_fb_ticker(lcd, c, i))
+      continue;
+
+    if(n && (plan->run[n-1].start + plan->run[n-1].len == i))
+      plan->run[n-1].len++;
+    else {
+      plan->run[n].start = i;
+      plan->run[n++].len = 1;
+    }
+  }
+
+  plan->n = n;
+  plan->start = 0;
+  plan->cost = 0;
+
+  /* runs may be written in any cyclic order since the address */
+  /* counter wraps. Try all of them and keep the cheapest */
+  for(s=0;s<n;s++) {
+    for(k=0;k<n;k++)
+      order[k] = plan->run[(s+k)%n];
+
+    i = lcd_plan_runs(lcd, c, order, n, lcd->fb_ac[c], 1, jump);
+    if(!s || i < plan->cost) {
+      plan->cost = i;
+      plan->start = s;
+      memcpy(plan->jump, jump, n);
+    }
+  }
+}
+
+/* transmit all cells that differ from the shadow copy to the display */
+/* or, if page is set, to the hidden page. Returns the number of cells */
+/* that have been written */
+static int lcd_fb_commit(lcd2usb_t *lcd, int page) {
+  int c, i, k, steps, shift[2], sel, changed = 0;
+  int ctrl[2] = { LCD2USB_CTRL_0, LCD2USB_CTRL_1 };
+  unsigned char jump[LCD_DDRAM_SIZE];
+  unsigned char frame[2][LCD_DDRAM_SIZE], visible[2][LCD_DDRAM_SIZE];
+  struct fb_plan plan[2], *p;
+  unsigned char *f;
+
+  /* return home brings an unknown display shift back to zero */
+  for(c=0;c<2;c++) {
+    if((lcd->fb_ctrl & (1<<c)) && (lcd->fb_shift[c] < 0)) {
+      if(lcd_command(lcd, ctrl[c], 0x03) < 0)
+	return -1;
+
+      lcd->fb_shift[c] = lcd->fb_ac[c] = 0;
+    }
+  }
+
+  if(lcd_fb_glyph_resolve(lcd) < 0)
+    return -1;
+
+  for(c=0;c<2;c++) {
+    if(!(lcd->fb_ctrl & (1<<c)))
+      continue;
+
+    /* plan the update with the current shift and with the shift */
+    /* wanted by a marquee and keep the cheaper one. The shift */
+    /* commands follow the data and need a packet or segment */
+    shift[0] = page?lcd_fb_hidden(lcd, c):lcd->fb_shift[c];
+    shift[1] = (page || lcd_fb_ticker(lcd, c, lcd->ticker_cell))?shift[0]:
+      (shift[0] + lcd->fb_scroll[c] + LCD_DDRAM_LINE) % LCD_DDRAM_LINE;
+    lcd->fb_scroll[c] = 0;
+
+    lcd_fb_render(lcd, c, shift[0], frame[0], visible[0]);
+    lcd_fb_plan(lcd, c, frame[0], visible[0], &plan[0]);
+    sel = 0;
+
+    if(shift[1] != shift[0]) {
+      steps = abs(lcd_fb_shift_steps(shift[0], shift[1]));
+      lcd_fb_render(lcd, c, shift[1], frame[1], visible[1]);
+      lcd_fb_plan(lcd, c, frame[1], visible[1], &plan[1]);
+
+      if(plan[1].cost + (lcd->long_enabled?1 + steps:
+			 (steps + BUFFER_MAX_CMD - 1) / BUFFER_MAX_CMD) <
+	 plan[0].cost)
+	sel = 1;
+    }
+
+    f = frame[sel];
+    p = &plan[sel];
+
+    if(p->n) {
+      lcd->stats.fb_cost_naive +=
+	lcd_plan_runs(lcd, c, p->run, p->n, lcd->fb_ac[c], 0, jump);
+      lcd->stats.fb_cost_planned += p->cost;
+    }
+
+    /* and finally send it */
+    for(k=0;k<p->n;k++) {
+      struct fb_run *r = &p->run[(p->start+k)%p->n];
+      int len = r->len;
+
+      if(p->jump[k]) {
+	if(lcd_command(lcd, ctrl[c], 0x80 | FB_ADDR(r->start)) < 0)
+	  return -1;
+	i = r->start;
+      } else {
+	/* rewrite the unchanged cells up to the run */
+	i = lcd->fb_ac[c];
+	len += lcd_plan_gap(i, r->start);
+      }
+
+      while(len--) {
+	if(lcd_enqueue(lcd, LCD_DATA | ctrl[c], f[i]) < 0)
+	  return -1;
+	lcd->fb_shadow[c][i] = f[i];
+	i = lcd_fb_next(i);
+      }
+
+      lcd->fb_ac[c] = i;
+      changed += r->len;
+    }
+
+    /* the cells are written before the window moves, so those */
+    /* entering the screen already show the right characters */
+    if(!page && (shift[sel] != lcd->fb_shift[c]) &&
+       (lcd_fb_shift(lcd, 1<<c, shift[sel]) < 0))
+      return -1;
+  }
+
+  if(lcd_flush(lcd) < 0)
+    return -1;
+
+  return changed;
+}
+
+/* ----------------------------- requests ------------------------------ */
+
+/* get a value from the lcd2usb interface */
+static int lcd_get(lcd2usb_t *lcd, unsigned char cmd) {
+  unsigned char       buffer[2];
+  int                 nBytes;
+
+  /* send control request and accept return value */
+  nBytes = lcd_control_in(lcd, cmd, 0, buffer, sizeof(buffer));
+
+  if(nBytes < 0) {
+    fprintf(stderr, "USB request failed!");
+    return -1;
+  }
+
+  return buffer[0] + 256*buffer[1];
+}
+
+/* Firmware 1.11 answers right after power-on while it still probes */
+/* the controllers in the background. Until it's done it reports both */
+/* of them and sets this flag in the descriptor's state and in the msb */
+/* of the controller map. The probing takes about 15ms */
+#define LCD_STATE_DETECTING  0x01
+#define LCD_STATE_MACRO      0x02   /* macro being stored or played */
+#define LCD_DETECT_TRIES     20
+#define LCD_DETECT_MS        5
+
+/* get the map of installed controllers once they are known */
+static int lcd_get_ctrl(lcd2usb_t *lcd) {
+  int ctrl, tries = 0;
+
+  while(((ctrl = lcd_get(lcd, LCD_GET_CTRL)) >= 0) &&
+	((ctrl >> 8) & LCD_STATE_DETECTING) && (tries++ < LCD_DETECT_TRIES))
+    MSLEEP(LCD_DETECT_MS);
+
+  return (ctrl < 0)?ctrl:(ctrl & 0xff);
+}
+
+/* The capability descriptor returned by firmware 1.11 and later: */
+/* descriptor version and size, firmware version, feature bitmap (2 */
+/* bytes), controller map, queue entries, max long transfer (2 bytes), */
+/* contrast, brightness, keys and state. Multi byte values are lsb first */
+#define LCD_CAPS_SIZE      14
+
+/* long transfers, key events, fades etc are supported since */
+/* firmware version 1.10 */
+#define LCD_FEATURES_1_10  (LCD2USB_FEATURE_LONG |			\
+			    LCD2USB_FEATURE_KEY_EVENTS |		\
+			    LCD2USB_FEATURE_QUEUE_STATE |		\
+			    LCD2USB_FEATURE_FADE |			\
+			    LCD2USB_FEATURE_PERSIST)
+
+static int lcd_has(lcd2usb_t *lcd, int features) {
+  return (lcd->caps.features & features) == features;
+}
+
+/* read the capability descriptor. Older firmware doesn't return */
+/* anything for it and is asked for version, controllers and keys */
+/* separately */
+static int lcd_get_caps(lcd2usb_t *lcd, struct lcd2usb_caps *caps) {
+  unsigned char buffer[LCD_CAPS_SIZE];
+  int nBytes, tries = 0;
+
+  /* ask again until the controllers have been probed */
+  while(((nBytes = lcd_control_in(lcd, LCD_GET_CAPS, 0, buffer, 
+				  sizeof(buffer))) == LCD_CAPS_SIZE) &&
+	(buffer[13] & LCD_STATE_DETECTING) && (tries++ < LCD_DETECT_TRIES))
+    MSLEEP(LCD_DETECT_MS);
+
+  if(nBytes < 0) {
+    fprintf(stderr, "USB request failed!");
+    return -1;
+  }
+
+  if((nBytes == LCD_CAPS_SIZE) && (buffer[0] >= 1) &&
+     (buffer[1] >= LCD_CAPS_SIZE)) {
+    caps->version = buffer[2] | (buffer[3] << 8);
+    caps->features = buffer[4] | (buffer[5] << 8);
+    caps->ctrl = buffer[6];
+    caps->queue = buffer[7];
+    caps->long_max = buffer[8] | (buffer[9] << 8);
+    caps->contrast = buffer[10];
+    caps->brightness = buffer[11];
+    caps->keys = buffer[12];
+    return 0;
+  }
+
+  if((caps->version = lcd_get(lcd, LCD_GET_FWVER)) < 0)
+    return -1;
+
+  caps->features = 0;
+  caps->queue = caps->long_max = 0;
+  if(((caps->version&0xff) > 1) || ((caps->version>>8) >= 10)) {
+    caps->features = LCD_FEATURES_1_10;
+    caps->queue = 64;
+    caps->long_max = LONG_MAX;
+  }
+
+  caps->contrast = caps->brightness = -1;
+  if(((caps->ctrl = lcd_get_ctrl(lcd)) < 0) ||
+     ((caps->keys = lcd_get(lcd, LCD_GET_KEYS)) < 0))
+    return -1;
+
+  return 0;
+}
+
+/* set a value in the LCD interface */
+static int lcd_set(lcd2usb_t *lcd, unsigned char cmd, int value, int index) {
+  return lcd_send(lcd, cmd, value, index);
+}
+
+/* ------------------------------ devices ------------------------------ */
+
+static lcd2usb_t *lcd_alloc(void) {
+  lcd2usb_t *lcd = calloc(1, sizeof(*lcd));
+
+  if(!lcd) {
+    fprintf(stderr, "Out of memory!");
+    return NULL;
+  }
+
+  MUTEX_INIT(&lcd->lock);
+  MUTEX_INIT(&lcd->pipe_lock);
+
+#ifndef WIN
+  lcd->emu_fd = -1;
+#endif
+  lcd->version = -1;
+  lcd->pipeline_depth = 8;
+  lcd->buffer_current_type = -1;
+  lcd->long_target = -1;
+  lcd->long_header = -1;
+  lcd->fb_ac[0] = lcd->fb_ac[1] = -1;
+  lcd->fb_shift[0] = lcd->fb_shift[1] = -1;
+  memset(lcd->fb_cell, -1, sizeof(lcd->fb_cell));
+
+  return lcd;
+}
+
+static void lcd_free(lcd2usb_t *lcd) {
+  if(lcd->handle) {
+    if(lcd->claimed)
+      libusb_release_interface(lcd->handle, 0);
+    libusb_close(lcd->handle);
+  }
+
+  if(lcd->usb_ctx)
+    libusb_exit(lcd->usb_ctx);
+
+#ifndef WIN
+  if(lcd->emu_fd >= 0) {
+    /* the emulator terminates once the connection is closed */
+    close(lcd->emu_fd);
+    waitpid(lcd->emu_pid, NULL, 0);
+  }
+#endif
+
+  MUTEX_DESTROY(&lcd->lock);
+  MUTEX_DESTROY(&lcd->pipe_lock);
+  free(lcd);
+}
+
+/* ask the device what it supports and use the fastest way of */
+/* talking to it */
+static lcd2usb_t *lcd_setup(lcd2usb_t *lcd) {
+  if(lcd_get_caps(lcd, &lcd->caps) < 0) {
+    lcd_free(lcd);
+    return NULL;
+  }
+
+  lcd->version = lcd->caps.version;
+  lcd->long_enabled = lcd_has(lcd, LCD2USB_FEATURE_LONG);
+  lcd->long_max = (lcd->caps.long_max < LONG_MAX)?lcd->caps.long_max:LONG_MAX;
+  lcd->goto_enabled = lcd_has(lcd, LCD2USB_FEATURE_GOTO |
+			      LCD2USB_FEATURE_MIXED);
+  return lcd;
+}
+
+/* the path of a device is made of its bus and port numbers, it */
+/* stays the same as long as the device is plugged into the same port */
+static void lcd_usb_path(libusb_device *dev, char *path, int size) {
+  uint8_t ports[8];
+  int i, n, len;
+
+  len = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+
+  n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  for(i=0;(i<n) && (len < size);i++)
+    len += snprintf(path+len, size-len, "%c%d", i?'.':'-', ports[i]);
+}
+
+static void lcd_usb_serial(libusb_device_handle *handle,
+			   struct libusb_device_descriptor *desc,
+			   char *serial, int size) {
+  *serial = 0;
+
+  if(desc->iSerialNumber &&
+     (libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber,
+			 (unsigned char*)serial, size) < 0))
+    *serial = 0;
+}
+
+/* call func for every lcd2usb device found, stops if func returns */
+/* non-zero. Returns the number of devices visited */
+static int lcd_usb_scan(libusb_context *ctx,
+		int (*func)(libusb_device *, struct libusb_device_descriptor *,
+			    void *), void *data) {
+  libusb_device       **list;
+  struct libusb_device_descriptor desc;
+  ssize_t             cnt;
+  int i, found = 0;
+
+  cnt = libusb_get_device_list(ctx, &list);
+
+  for(i=0;i<cnt;i++) {
+    if(libusb_get_device_descriptor(list[i], &desc) < 0)
+      continue;
+
+    if((desc.idVendor == LCD2USB_VID) && (desc.idProduct == LCD2USB_PID)) {
+      found++;
+      if(func(list[i], &desc, data))
+	break;
+    }
+  }
+
+  if(cnt > 0)
+    libusb_free_device_list(list, 1);
+
+  return found;
+}
+
+struct lcd_list {
+  struct lcd2usb_info *info;
+  int max, num;
+};
+
+static int lcd_list_func(libusb_device *dev,
+			 struct libusb_device_descriptor *desc, void *data) {
+  struct lcd_list *list = data;
+  struct lcd2usb_info *info = &list->info[list->num];
+  libusb_device_handle *handle;
+
+  if(list->num == list->max)
+    return 0;
+
+  lcd_usb_path(dev, info->path, sizeof(info->path));
+
+  /* reading the serial number requires access to the device */
+  info->serial[0] = 0;
+  if(libusb_open(dev, &handle) == 0) {
+    lcd_usb_serial(handle, desc, info->serial, sizeof(info->serial));
+    libusb_close(handle);
+  }
+
+  list->num++;
+  return 0;
+}
+
+int lcd2usb_list(struct lcd2usb_info *info, int max) {
+  libusb_context *ctx;
+  struct lcd_list list = { info, max, 0 };
+  int ret;
+
+  if((ret = libusb_init(&ctx)) < 0) {
+    fprintf(stderr, "Error: Cannot init libusb: %s\n", libusb_error_name(ret));
+    return -1;
+  }
+
+  ret = lcd_usb_scan(ctx, lcd_list_func, &list);
+  libusb_exit(ctx);
+
+  return ret;
+}
+
+/* open the device at the given path or the first one if path is NULL */
+struct lcd_open {
+  lcd2usb_t *lcd;
+  const char *path;
+};
+
+static int lcd_open_func(libusb_device *dev,
+			 struct libusb_device_descriptor *desc, void *data) {
+  struct lcd_open *req = data;
+  lcd2usb_t *lcd = req->lcd;
+  int ret;
+
+  lcd_usb_path(dev, lcd->info.path, sizeof(lcd->info.path));
+  if(req->path && strcmp(req->path, lcd->info.path))
+    return 0;
+
+  /* open device */
+  if((ret = libusb_open(dev, &lcd->handle)) < 0) {
+    fprintf(stderr, "Error: Cannot open USB device: %s\n",
+	    libusb_error_name(ret));
+    lcd->handle = NULL;
+  } else
+    lcd_usb_serial(lcd->handle, desc, lcd->info.serial,
+		   sizeof(lcd->info.serial));
+
+  return 1;
+}
+
+static lcd2usb_t *lcd_usb_open(const char *path) {
+  struct lcd_open req;
+  lcd2usb_t *lcd;
+  int ret;
+
+  if(!(lcd = lcd_alloc()))
+    return NULL;
+
+  if((ret = libusb_init(&lcd->usb_ctx)) < 0) {
+    fprintf(stderr, "Error: Cannot init libusb: %s\n", libusb_error_name(ret));
+    lcd->usb_ctx = NULL;
+    lcd_free(lcd);
+    return NULL;
+  }
+
+  req.lcd = lcd;
+  req.path = path;
+  lcd_usb_scan(lcd->usb_ctx, lcd_open_func, &req);
+
+  if(!lcd->handle) {
+    lcd_free(lcd);
+    return NULL;
+  }
+
+  return lcd_setup(lcd);
+}
+
+/* search for the first lcd2usb device and open it */
+lcd2usb_t *lcd2usb_open(void) {
+  return lcd_usb_open(NULL);
+}
+
+lcd2usb_t *lcd2usb_open_path(const char *path) {
+  return lcd_usb_open(path);
+}
+
+void lcd2usb_get_info(lcd2usb_t *lcd, struct lcd2usb_info *info) {
+  MUTEX_LOCK(&lcd->lock);
+  *info = lcd->info;
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+#ifndef WIN
+lcd2usb_t *lcd2usb_open_emu(const char *cmd, int latency) {
+  lcd2usb_t *lcd;
+
+  if(!(lcd = lcd_alloc()))
+    return NULL;
+
+  lcd->emu_latency = latency;
+  if(lcd_emu_open(lcd, cmd) < 0) {
+    lcd_free(lcd);
+    return NULL;
+  }
+
+  snprintf(lcd->info.path, sizeof(lcd->info.path), "emu-%d", (int)lcd->emu_pid);
+
+  return lcd_setup(lcd);
+}
+#endif
+
+void lcd2usb_close(lcd2usb_t *lcd) {
+  MUTEX_LOCK(&lcd->lock);
+  lcd_flush(lcd);
+  lcd_pipeline_drain(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  lcd_free(lcd);
+}
+
+/* ----------------------------- transfers ----------------------------- */
+
+int lcd2usb_set_depth(lcd2usb_t *lcd, int depth) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_flush(lcd);
+  ret |= lcd_pipeline_drain(lcd);
+
+  if(depth < 1) depth = 1;
+  if(depth > PIPELINE_MAX) depth = PIPELINE_MAX;
+  lcd->pipeline_depth = depth;
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_set_long(lcd2usb_t *lcd, int enable) {
+  int ret = 0;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(enable && !lcd_has(lcd, LCD2USB_FEATURE_LONG))
+    ret = -1;
+  else {
+    ret = lcd_flush(lcd);
+    lcd->long_enabled = enable;
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_flush(lcd2usb_t *lcd) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_flush(lcd);
+  ret |= lcd_pipeline_drain(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+void lcd2usb_get_stats(lcd2usb_t *lcd, struct lcd2usb_stats *stats) {
+  MUTEX_LOCK(&lcd->lock);
+  *stats = lcd->stats;
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+int lcd2usb_pending(lcd2usb_t *lcd) {
+  int pending;
+
+  MUTEX_LOCK(&lcd->lock);
+  pending = lcd->queue_head - lcd->queue_tail + lcd_pipeline_pending(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return pending;
+}
+
+/* -------------------------- device requests -------------------------- */
+
+int lcd2usb_echo(lcd2usb_t *lcd, int value) {
+  unsigned char buffer[2];
+  int nBytes;
+
+  MUTEX_LOCK(&lcd->lock);
+  lcd_flush(lcd);
+  nBytes = lcd_control_in(lcd, LCD_ECHO, value, buffer, sizeof(buffer));
+  MUTEX_UNLOCK(&lcd->lock);
+
+  if(nBytes != sizeof(buffer))
+    return -1;
+
+  return buffer[0] | (buffer[1] << 8);
+}
+
+static int lcd2usb_get(lcd2usb_t *lcd, unsigned char cmd) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  lcd_flush(lcd);
+  ret = lcd_get(lcd, cmd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_get_version(lcd2usb_t *lcd) {
+  return lcd2usb_get(lcd, LCD_GET_FWVER);
+}
+
+int lcd2usb_get_controller(lcd2usb_t *lcd) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  lcd_flush(lcd);
+  ret = lcd_get_ctrl(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_get_keys(lcd2usb_t *lcd) {
+  return lcd2usb_get(lcd, LCD_GET_KEYS);
+}
+
+void lcd2usb_get_caps(lcd2usb_t *lcd, struct lcd2usb_caps *caps) {
+  MUTEX_LOCK(&lcd->lock);
+  *caps = lcd->caps;
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+/* The firmware queues commands and data and writes them to the lcd */
+/* from its main loop. A command or data request sent as control-in */
+/* transfer returns the number of free queue entries and how often */
+/* the queue overflowed since the last report. A command addressed to */
+/* no controller at all doesn't touch the display */
+int lcd2usb_get_queue(lcd2usb_t *lcd, int *overflows) {
+  unsigned char       buffer[2];
+  int                 nBytes;
+
+  MUTEX_LOCK(&lcd->lock);
+
+  /* make sure all buffered output is sent first */
+  lcd_flush(lcd);
+  nBytes = lcd_control_in(lcd, LCD_CMD, 0, buffer, sizeof(buffer));
+
+  MUTEX_UNLOCK(&lcd->lock);
+
+  if(nBytes != sizeof(buffer)) {
+    fprintf(stderr, "USB request failed!");
+    return -1;
+  }
+
+  if(overflows) *overflows = buffer[1];
+  return buffer[0];
+}
+
+/* Firmware 1.10 and later sends debounced key events via the */
+/* interrupt-in endpoint instead of having the host poll the keys. */
+/* With a real device the context lock isn't held while waiting, so */
+/* other threads may keep updating the display meanwhile */
+int lcd2usb_get_key_event(lcd2usb_t *lcd, struct lcd2usb_key_event *ev,
+			  int timeout) {
+  unsigned char buffer[4];
+  int ret, len = 0;
+
+#ifndef WIN
+  if(lcd->emu_fd >= 0) {
+    unsigned char setup[8] = { 0xff, 0, 0, 0, 0, 0, sizeof(buffer), 0 };
+    unsigned char hdr[3], dummy;
+    int i;
+
+    /* poll the endpoint like the host controller would do */
+    for(;;) {
+      MUTEX_LOCK(&lcd->lock);
+
+      /* the emulator answers in order, so pending output goes first */
+      ret = lcd_flush(lcd);
+      ret |= lcd_pipeline_drain(lcd);
+
+      if(!ret && ((lcd_emu_io(lcd, 1, setup, sizeof(setup)) < 0) ||
+		  (lcd_emu_io(lcd, 0, hdr, sizeof(hdr)) < 0)))
+	ret = -1;
+
+      len = ret?0:(hdr[1] | (hdr[2] << 8));
+      for(i=0;i<len;i++)
+	if(lcd_emu_io(lcd, 0, (i < sizeof(buffer))?buffer+i:&dummy, 1) < 0)
+	  ret = -1;
+
+      MUTEX_UNLOCK(&lcd->lock);
+
+      if(ret < 0)
+	return -1;
+
+      if(!hdr[0])
+	break;
+
+      if(timeout <= 0)
+	return 0;
+
+      /* poll interval of the interrupt endpoint */
+      MSLEEP(10);
+      timeout -= 10;
+    }
+  } else
+#endif
+  {
+    /* interrupt transfers require the interface to be claimed */
+    MUTEX_LOCK(&lcd->lock);
+    ret = 0;
+    if(!lcd->claimed) {
+      if((ret = libusb_claim_interface(lcd->handle, 0)) < 0)
+	fprintf(stderr, "USB claim interface failed: %s\n",
+		libusb_error_name(ret));
+      else
+	lcd->claimed = 1;
+    }
+    MUTEX_UNLOCK(&lcd->lock);
+
+    if(ret < 0)
+      return -1;
+
+    ret = libusb_interrupt_transfer(lcd->handle, LCD_KEY_EP, buffer,
+			  sizeof(buffer), &len, timeout);
+    if(ret == LIBUSB_ERROR_TIMEOUT)
+      return 0;
+
+    if(ret < 0) {
+      fprintf(stderr, "USB interrupt transfer failed: %s\n",
+	      libusb_error_name(ret));
+      return -1;
+    }
+  }
+
+  if(len < sizeof(buffer)) {
+    fprintf(stderr, "Short key event!");
+    return -1;
+  }
+
+  ev->keys = buffer[0];
+  ev->changed = buffer[1] & ~LCD_KEY_LOST;
+  ev->lost = (buffer[1] & LCD_KEY_LOST)?1:0;
+  ev->time = buffer[2] | (buffer[3] << 8);
+  return 1;
+}
+
+static int lcd2usb_set(lcd2usb_t *lcd, unsigned char cmd, int value,
+		       int index, int feature) {
+  int ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(lcd_has(lcd, feature)) {
+    ret = lcd_flush(lcd);
+    ret |= lcd_set(lcd, cmd, value, index);
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* set contrast to a value between 0 and 255. Result depends */
+/* display type */
+int lcd2usb_set_contrast(lcd2usb_t *lcd, int value) {
+  return lcd2usb_set(lcd, LCD_SET_CONTRAST, value, 0, 0);
+}
+
+/* set backlight brightness to a value between 0 (off) anf 255 */
+int lcd2usb_set_brightness(lcd2usb_t *lcd, int value) {
+  return lcd2usb_set(lcd, LCD_SET_BRIGHTNESS, value, 0, 0);
+}
+
+int lcd2usb_fade(lcd2usb_t *lcd, int what, int value, int ms) {
+  return lcd2usb_set(lcd, LCD_SET_FADE, value | (what << 8), ms,
+		     LCD2USB_FEATURE_FADE);
+}
+
+int lcd2usb_set_persist_delay(lcd2usb_t *lcd, int delay) {
+  return lcd2usb_set(lcd, LCD_SET_CONFIG,
+		     LCD_CONFIG_PERSIST | (delay << 8), 0,
+		     LCD2USB_FEATURE_PERSIST);
+}
+
+int lcd2usb_save_settings(lcd2usb_t *lcd) {
+  return lcd2usb_set(lcd, LCD_SET_CONFIG, LCD_CONFIG_SAVE, 0,
+		     LCD2USB_FEATURE_PERSIST);
+}
+
+int lcd2usb_set_timed(lcd2usb_t *lcd, int enable) {
+  return lcd2usb_set(lcd, LCD_SET_CONFIG,
+		     LCD_CONFIG_TIMED | ((enable?1:0) << 8), 0,
+		     LCD2USB_FEATURE_TIMED);
+}
+
+/* ------------------------------ display ------------------------------ */
+
+int lcd2usb_command(lcd2usb_t *lcd, int ctrl, int cmd) {
+  int ret, c;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_command(lcd, ctrl & LCD2USB_BOTH, cmd);
+
+  /* the shadow framebuffer and the glyph cache can't follow */
+  /* arbitrary commands */
+  lcd_fb_invalidate(lcd);
+  lcd_glyph_invalidate(lcd);
+
+  /* clear and return home reset the display shift, display shifts */
+  /* and the entry mode shift change it */
+  for(c=0;c<2;c++) {
+    if(!(ctrl & (c?LCD2USB_CTRL_1:LCD2USB_CTRL_0)))
+      continue;
+
+    if((cmd == 0x01) || ((cmd & 0xfe) == 0x02))
+      lcd->fb_shift[c] = 0;
+    else if(((cmd & 0xf8) == 0x18) || ((cmd & 0xfd) == 0x05))
+      lcd->fb_shift[c] = -1;
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_data(lcd2usb_t *lcd, int ctrl, int data) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_enqueue(lcd, LCD_DATA | (ctrl & LCD2USB_BOTH), data);
+  lcd_fb_invalidate(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* clear display */
+int lcd2usb_clear(lcd2usb_t *lcd) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_command(lcd, LCD2USB_BOTH, 0x01);    /* clear display */
+  ret |= lcd_command(lcd, LCD2USB_BOTH, 0x03);   /* return home */
+  ret |= lcd_flush(lcd);
+
+  lcd_fb_blank(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* home display */
+int lcd2usb_home(lcd2usb_t *lcd) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_command(lcd, LCD2USB_BOTH, 0x03);    /* return home */
+  ret |= lcd_flush(lcd);
+
+  lcd->fb_ac[0] = lcd->fb_ac[1] = 0;
+  lcd->fb_shift[0] = lcd->fb_shift[1] = 0;
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* write a data string to the first display */
+int lcd2usb_write(lcd2usb_t *lcd, const char *data) {
+  int ret = 0;
+
+  MUTEX_LOCK(&lcd->lock);
+  while(*data)
+    ret |= lcd_enqueue(lcd, LCD_DATA | LCD2USB_CTRL_0, *data++);
+
+  ret |= lcd_flush(lcd);
+
+  /* the shadow framebuffer doesn't know what has been written */
+  lcd_fb_invalidate(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_write_cells(lcd2usb_t *lcd, int ctrl, int cell,
+			const unsigned char *data, int len) {
+  unsigned char buf[LONG_MAX];
+  int c, i, n, ret = 0;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(!lcd_has(lcd, LCD2USB_FEATURE_FB) || (cell < 0) ||
+     (cell >= LCD_DDRAM_SIZE) || (len < 0) ||
+     !(ctrl & LCD2USB_BOTH))
+    ret = -1;
+  else {
+    ret = lcd_flush(lcd);
+
+    while(!ret && len) {
+      n = (len > lcd->long_max)?lcd->long_max:len;
+      memcpy(buf, data, n);
+      ret = lcd_send_data(lcd, LCD_LONG | LONG_FB | (ctrl & LCD2USB_BOTH),
+			  cell, 0, buf, n);
+      lcd->queue_free = 0;      /* up to two entries per cell */
+
+      /* the host framebuffer now knows the cells, but not where */
+      /* the device has left the address counter */
+      for(c=0;c<2;c++) {
+	if(!(ctrl & (c?LCD2USB_CTRL_1:LCD2USB_CTRL_0)))
+	  continue;
+
+	for(i=0;i<n;i++)
+	  lcd->fb_shadow[c][(cell + i) % LCD_DDRAM_SIZE] = data[i];
+	lcd->fb_ac[c] = -1;
+      }
+
+      cell = (cell + n) % LCD_DDRAM_SIZE;
+      data += n;
+      len -= n;
+    }
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* ---------------------------- framebuffer ---------------------------- */
+
+int lcd2usb_fb_init(lcd2usb_t *lcd, int ctrl, int rows, int cols) {
+  int r, i, c;
+
+  if((ctrl < 1) || (ctrl > 3) || (rows < 1) || (rows > 4) || (cols < 1))
+    return -1;
+
+  /* a single controller shows lines 2 and 3 behind lines 0 and 1 */
+  if((ctrl != 3) && (rows > 2) && (2*cols > LCD_DDRAM_LINE))
+    return -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  lcd->fb_ctrl = ctrl;
+  lcd->fb_rows = rows;
+  lcd->fb_cols = (cols > LCD_DDRAM_LINE)?LCD_DDRAM_LINE:cols;
+
+  /* only visible cells need to be updated, the others may */
+  /* still be overwritten if that saves transfers */
+  memset(lcd->fb_visible, 0, sizeof(lcd->fb_visible));
+  for(r=0;r<lcd->fb_rows;r++)
+    for(i=0;i<lcd->fb_cols;i++)
+      lcd->fb_visible[0][lcd_fb_locate(lcd, r, i, &c) + c*LCD_DDRAM_SIZE] = 1;
+
+  memset(lcd->fb_frame, ' ', sizeof(lcd->fb_frame));
+  memset(lcd->fb_cell, -1, sizeof(lcd->fb_cell));
+  memset(lcd->marquee, 0, sizeof(lcd->marquee));
+  lcd->fb_scroll[0] = lcd->fb_scroll[1] = 0;
+  lcd->fb_glyphs = 0;
+  lcd_fb_invalidate(lcd);
+  lcd_glyph_invalidate(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return 0;
+}
+
+void lcd2usb_fb_clear(lcd2usb_t *lcd) {
+  MUTEX_LOCK(&lcd->lock);
+  memset(lcd->fb_frame, ' ', sizeof(lcd->fb_frame));
+  memset(lcd->fb_cell, -1, sizeof(lcd->fb_cell));
+  lcd->fb_glyphs = 0;
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+void lcd2usb_fb_print(lcd2usb_t *lcd, int row, int col, const char *str) {
+  int c, i;
+
+  MUTEX_LOCK(&lcd->lock);
+  if((row >= 0) && (row < lcd->fb_rows) && (col >= 0)) {
+    while(*str && (col < lcd->fb_cols)) {
+      i = lcd_fb_locate(lcd, row, col++, &c);
+      lcd->fb_frame[c][i] = *str++;
+      lcd->fb_cell[c][i] = -1;
+    }
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+int lcd2usb_fb_glyph(lcd2usb_t *lcd, int row, int col,
+		     const unsigned char *glyph) {
+  int c, i, g, ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if((row >= 0) && (row < lcd->fb_rows) && (col >= 0) &&
+     (col < lcd->fb_cols) && ((g = lcd_fb_glyph_find(lcd, glyph)) >= 0)) {
+    i = lcd_fb_locate(lcd, row, col, &c);
+    lcd->fb_cell[c][i] = g;
+    ret = 0;
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* draw the part of a marquee's text that's shown at its position */
+static void lcd_marquee_draw(lcd2usb_t *lcd, int row) {
+  struct lcd_marquee *m = &lcd->marquee[row];
+  int c, i, col;
+
+  for(col=0;col<lcd->fb_cols;col++) {
+    i = lcd_fb_locate(lcd, row, col, &c);
+    lcd->fb_frame[c][i] = m->text[(m->pos + col) % m->len];
+    lcd->fb_cell[c][i] = -1;
+  }
+}
+
+int lcd2usb_marquee(lcd2usb_t *lcd, int row, const char *text) {
+  struct lcd_marquee *m;
+  int ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if((row >= 0) && (row < lcd->fb_rows)) {
+    m = &lcd->marquee[row];
+    m->len = strlen(text);
+    if(m->len > LCD_MARQUEE_MAX)
+      m->len = LCD_MARQUEE_MAX;
+
+    memcpy(m->text, text, m->len);
+    m->pos = 0;
+
+    if(m->len)
+      lcd_marquee_draw(lcd, row);
+    ret = 0;
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_marquee_step(lcd2usb_t *lcd) {
+  struct lcd_marquee *m;
+  int r, c, ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  for(r=0;r<lcd->fb_rows;r++) {
+    m = &lcd->marquee[r];
+    if(!m->len)
+      continue;
+
+    m->pos = (m->pos + 1) % m->len;
+    lcd_marquee_draw(lcd, r);
+
+    /* moving the window along with the text keeps the characters */
+    /* in place that are already in ddram */
+    lcd_fb_locate(lcd, r, 0, &c);
+    lcd->fb_scroll[c] = 1;
+  }
+
+  ret = lcd_fb_commit(lcd, 0);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_ticker(lcd2usb_t *lcd, int row, int col, int width,
+		   const char *text, int ms) {
+  unsigned char buf[LCD_TICKER_MAX];
+  int c, i, cell, len = strlen(text), ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(lcd_has(lcd, LCD2USB_FEATURE_TICKER) && (row >= 0) &&
+     (row < lcd->fb_rows) && (col >= 0) && (col < lcd->fb_cols) &&
+     (width > 0) && (ms >= 0) && (ms <= 0xffff)) {
+    if(width > lcd->fb_cols - col)
+      width = lcd->fb_cols - col;
+    if(len > LCD_TICKER_MAX)
+      len = LCD_TICKER_MAX;
+    cell = lcd_fb_locate(lcd, row, col, &c);
+
+    /* the next commit redraws the window of the previous ticker */
+    for(i=0;i<lcd->ticker_width;i++)
+      lcd->fb_shadow[lcd->ticker_c][(lcd->ticker_cell + i) %
+				    LCD_DDRAM_SIZE] = -1;
+    lcd->ticker_width = 0;
+
+    /* the ticker's cells don't move with the display shift */
+    ret = 0;
+    if(len && lcd->fb_shift[c]) {
+      ret = lcd_command(lcd, c?LCD2USB_CTRL_1:LCD2USB_CTRL_0, 0x03);
+      lcd->fb_shift[c] = lcd->fb_ac[c] = 0;
+    }
+
+    ret |= lcd_flush(lcd);
+
+    memcpy(buf, text, len);
+    if(!ret)
+      ret = lcd_send_data(lcd, LCD_TICKER |
+			  (c?LCD2USB_CTRL_1:LCD2USB_CTRL_0),
+			  cell | (width << 8), ms, buf, len);
+
+    /* the steps of the ticker take queue entries from now on */
+    lcd->queue_free = 0;
+
+    if(!ret && len) {
+      lcd->ticker_c = c;
+      lcd->ticker_cell = cell;
+      lcd->ticker_width = width;
+    }
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_page_render(lcd2usb_t *lcd) {
+  int ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(lcd->fb_ctrl && !lcd->ticker_width &&
+     (2*lcd_fb_width(lcd) <= LCD_DDRAM_LINE))
+    ret = lcd_fb_commit(lcd, 1);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_page_flip(lcd2usb_t *lcd) {
+  int c, ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(lcd->fb_ctrl && !lcd->ticker_width &&
+     (2*lcd_fb_width(lcd) <= LCD_DDRAM_LINE) &&
+     ((ret = lcd_fb_commit(lcd, 1)) >= 0)) {
+    /* both controllers of a dual controller display flip at once */
+    if((lcd->fb_ctrl == 3) && (lcd->fb_shift[0] == lcd->fb_shift[1])) {
+      if(lcd_fb_shift(lcd, 3, lcd_fb_hidden(lcd, 0)) < 0)
+	ret = -1;
+    } else {
+      for(c=0;c<2;c++)
+	if((lcd->fb_ctrl & (1<<c)) &&
+	   (lcd_fb_shift(lcd, 1<<c, lcd_fb_hidden(lcd, c)) < 0))
+	  ret = -1;
+    }
+
+    if(lcd_flush(lcd) < 0)
+      ret = -1;
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+void lcd2usb_fb_invalidate(lcd2usb_t *lcd) {
+  MUTEX_LOCK(&lcd->lock);
+  lcd_fb_invalidate(lcd);
+  lcd_glyph_invalidate(lcd);
+  lcd->fb_shift[0] = lcd->fb_shift[1] = -1;
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+void lcd2usb_fb_blank(lcd2usb_t *lcd) {
+  MUTEX_LOCK(&lcd->lock);
+  lcd_fb_blank(lcd);
+  MUTEX_UNLOCK(&lcd->lock);
+}
+
+int lcd2usb_fb_commit(lcd2usb_t *lcd) {
+  int ret;
+
+  MUTEX_LOCK(&lcd->lock);
+  ret = lcd_fb_commit(lcd, 0);
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* ------------------------------- macros ------------------------------ */
+
+/* the device rejects macro requests while it's still storing the */
+/* bytes of the previous one, so wait until it's done */
+static int lcd_macro_wait(lcd2usb_t *lcd) {
+  int state, tries = 0;
+
+  if(lcd_pipeline_drain(lcd))
+    return -1;
+
+  while(((state = lcd_get(lcd, LCD_GET_CTRL)) >= 0) &&
+	((state >> 8) & LCD_STATE_MACRO)) {
+    if(tries++ == LCD_MACRO_TRIES)
+      return -1;
+
+    MSLEEP(LCD_MACRO_MS);
+  }
+
+  return (state < 0)?-1:0;
+}
+
+int lcd2usb_macro_store(lcd2usb_t *lcd, int slot, const int *seq, int len) {
+  unsigned char buf[LCD_MACRO_MAX];
+  int i, type, n = 0, hdr = -1, ret = -1;
+
+  /* encode as segments like a long transfer */
+  for(i=0;i<len;i++) {
+    type = (seq[i] & LCD2USB_MACRO_DATA)?LONG_DATA:0;
+
+    if((hdr < 0) || ((buf[hdr] & LONG_DATA) != type) ||
+       ((buf[hdr] & ~LONG_DATA) == LONG_SEGMENT - 1)) {
+      if(n == LCD_MACRO_MAX)
+	return -1;
+
+      hdr = n;
+      buf[n++] = type;
+    } else
+      buf[hdr]++;
+
+    if(n == LCD_MACRO_MAX)
+      return -1;
+    buf[n++] = seq[i] & 0xff;
+  }
+
+  MUTEX_LOCK(&lcd->lock);
+  if(lcd_has(lcd, LCD2USB_FEATURE_MACROS) && (slot >= 0) &&
+     (slot < LCD2USB_MACRO_SLOTS)) {
+    ret = lcd_flush(lcd);
+
+    /* the timeout of a transfer starts when it's submitted, so each */
+    /* part waits for the previous one to be stored */
+    for(i=0;!ret && (i < n);i+=LCD_MACRO_PART) {
+      ret = lcd_macro_wait(lcd);
+      if(!ret)
+	ret = lcd_send_data(lcd, LCD_MACRO, slot | (LCD_MACRO_WRITE << 8), i,
+			    buf + i, (n-i > LCD_MACRO_PART)?LCD_MACRO_PART:n-i);
+    }
+
+    /* the length is stored last, the macro is complete once it's done */
+    if(!ret)
+      ret = lcd_macro_wait(lcd);
+    if(!ret)
+      ret = lcd_send(lcd, LCD_MACRO, slot | (LCD_MACRO_END << 8), n);
+    if(!ret)
+      ret = lcd_macro_wait(lcd);
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+int lcd2usb_macro_play(lcd2usb_t *lcd, int ctrl, int slot) {
+  unsigned char dummy = 0;
+  int c, ret = -1;
+
+  MUTEX_LOCK(&lcd->lock);
+  if(lcd_has(lcd, LCD2USB_FEATURE_MACROS) && (slot >= 0) &&
+     (slot < LCD2USB_MACRO_SLOTS)) {
+    /* the device holds off the byte in the data stage until it has */
+    /* queued the whole macro, so what's sent afterwards follows it */
+    ret = lcd_flush(lcd);
+    if(!ret)
+      ret = lcd_send_data(lcd, LCD_MACRO | (ctrl & LCD2USB_BOTH),
+			  slot | (LCD_MACRO_PLAY << 8), 0, &dummy, 1);
+
+    /* the macro may contain anything */
+    lcd->queue_free = 0;
+    lcd_fb_invalidate(lcd);
+    lcd_glyph_invalidate(lcd);
+    for(c=0;c<2;c++)
+      if(ctrl & (c?LCD2USB_CTRL_1:LCD2USB_CTRL_0))
+	lcd->fb_shift[c] = -1;
+  }
+  MUTEX_UNLOCK(&lcd->lock);
+
+  return ret;
+}
+
+/* ------------------------------ manager ------------------------------ */
+
+#ifdef __linux__
+struct lcd2usb_manager {
+  int epfd;                    /* epoll instance watching all devices */
+  int num, max;
+  lcd2usb_t **dev;
+  int next;                    /* device to be served first */
+};
+
+/* libusb tells which file descriptors to watch for a context */
+static void LIBUSB_CALL lcd_mgr_fd_added(int fd, short events, void *data) {
+  lcd2usb_t *lcd = data;
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((events & POLLIN)?EPOLLIN:0) | ((events & POLLOUT)?EPOLLOUT:0);
+  ev.data.ptr = lcd;
+  epoll_ctl(lcd->mgr->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void LIBUSB_CALL lcd_mgr_fd_removed(int fd, void *data) {
+  lcd2usb_t *lcd = data;
+
+  epoll_ctl(lcd->mgr->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+lcd2usb_manager_t *lcd2usb_manager_new(void) {
+  lcd2usb_manager_t *mgr = calloc(1, sizeof(*mgr));
+
+  if(!mgr) {
+    fprintf(stderr, "Out of memory!");
+    return NULL;
+  }
+
+  if((mgr->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll_create1");
+    free(mgr);
+    return NULL;
+  }
+
+  return mgr;
+}
+
+void lcd2usb_manager_free(lcd2usb_manager_t *mgr) {
+  int i;
+
+  lcd2usb_manager_flush(mgr);
+
+  for(i=0;i<mgr->num;i++) {
+    if(mgr->dev[i]->usb_ctx)
+      libusb_set_pollfd_notifiers(mgr->dev[i]->usb_ctx, NULL, NULL, NULL);
+
+    mgr->dev[i]->mgr = NULL;
+    lcd2usb_close(mgr->dev[i]);
+  }
+
+  close(mgr->epfd);
+  free(mgr->dev);
+  free(mgr);
+}
+
+int lcd2usb_manager_add(lcd2usb_manager_t *mgr, lcd2usb_t *lcd) {
+  const struct libusb_pollfd **fds;
+  lcd2usb_t **dev;
+  int i;
+
+  if(mgr->num == mgr->max) {
+    dev = realloc(mgr->dev, (mgr->max + 16) * sizeof(*dev));
+    if(!dev) {
+      fprintf(stderr, "Out of memory!");
+      return -1;
+    }
+
+    mgr->dev = dev;
+    mgr->max += 16;
+  }
+
+  MUTEX_LOCK(&lcd->lock);
+
+  /* from now on output is queued */
+  lcd_flush(lcd);
+  lcd_pipeline_drain(lcd);
+  lcd->mgr = mgr;
+
+  if(lcd->emu_fd >= 0)
+    lcd_mgr_fd_added(lcd->emu_fd, POLLIN, lcd);
+  else {
+    libusb_set_pollfd_notifiers(lcd->usb_ctx, lcd_mgr_fd_added,
+				lcd_mgr_fd_removed, lcd);
+
+    if((fds = libusb_get_pollfds(lcd->usb_ctx))) {
+      for(i=0;fds[i];i++)
+	lcd_mgr_fd_added(fds[i]->fd, fds[i]->events, lcd);
+      libusb_free_pollfds(fds);
+    }
+  }
+
+  MUTEX_UNLOCK(&lcd->lock);
+
+  mgr->dev[mgr->num++] = lcd;
+  return 0;
+}
+
+int lcd2usb_manager_open_all(lcd2usb_manager_t *mgr) {
+  struct lcd2usb_info info[32];
+  lcd2usb_t *lcd;
+  int i, num, added = 0;
+
+  if((num = lcd2usb_list(info, sizeof(info)/sizeof(info[0]))) < 0)
+    return -1;
+
+  for(i=0;(i<num) && (i<sizeof(info)/sizeof(info[0]));i++) {
+    if(!(lcd = lcd2usb_open_path(info[i].path)))
+      continue;
+
+    if(lcd2usb_manager_add(mgr, lcd) < 0) {
+      lcd2usb_close(lcd);
+      continue;
+    }
+
+    added++;
+  }
+
+  return added;
+}
+
+/* process whatever has happened on a device, "ready" is set if one */
+/* of its file descriptors has become ready. Returns the time in ms */
+/* until the device needs attention again, -1 if it doesn't */
+static int lcd_mgr_events(lcd2usb_t *lcd, int ready) {
+  struct timeval tv = { 0, 0 };
+  struct pollfd pfd;
+  unsigned long seq;
+  long us;
+
+  if(lcd->emu_fd < 0) {
+    /* transfer timeouts are handled by libusb as well */
+    if(ready || ((libusb_get_next_timeout(lcd->usb_ctx, &tv) == 1) &&
+		 !tv.tv_sec && !tv.tv_usec)) {
+      tv.tv_sec = tv.tv_usec = 0;
+      libusb_handle_events_timeout_completed(lcd->usb_ctx, &tv, NULL);
+    }
+
+    if(libusb_get_next_timeout(lcd->usb_ctx, &tv) == 1)
+      return tv.tv_sec*1000 + (tv.tv_usec + 999)/1000;
+
+    return -1;
+  }
+
+  /* fetch all replies available */
+  pfd.fd = lcd->emu_fd;
+  pfd.events = POLLIN;
+  while(ready && (lcd->emu_received != lcd->pipeline_submitted) &&
+	(poll(&pfd, 1, 0) == 1))
+    lcd_emu_receive(lcd);
+
+  /* and complete those whose round trip time has passed */
+  while((seq = lcd->pipeline_completed) != lcd->emu_received) {
+    if((us = lcd_emu_due(lcd, seq)) > 0)
+      return (us + 999)/1000;
+
+    lcd_pipeline_complete(lcd, seq, !lcd->emu_status[seq % PIPELINE_MAX]);
+  }
+
+  return -1;
+}
+
+int lcd2usb_manager_run(lcd2usb_manager_t *mgr, int timeout) {
+  struct epoll_event ev[16];
+  lcd2usb_t *lcd;
+  int i, n, ms, progress, pending;
+
+  if(!mgr->num)
+    return 0;
+
+  /* fair scheduling: every device with queued transfers and a free */
+  /* slot in its pipeline gets to submit one transfer per round */
+  do {
+    progress = 0;
+
+    for(i=0;i<mgr->num;i++) {
+      lcd = mgr->dev[(mgr->next + i) % mgr->num];
+
+      MUTEX_LOCK(&lcd->lock);
+      if((lcd->queue_head != lcd->queue_tail) &&
+	 (lcd_pipeline_pending(lcd) < lcd->pipeline_depth)) {
+	if(lcd_queue_submit(lcd) < 0) {
+	  MUTEX_UNLOCK(&lcd->lock);
+	  return -1;
+	}
+	progress = 1;
+      }
+      MUTEX_UNLOCK(&lcd->lock);
+    }
+  } while(progress);
+
+  /* the next round starts with the next device */
+  mgr->next = (mgr->next + 1) % mgr->num;
+
+  /* wait for completions, but not longer than needed by the devices */
+  pending = 0;
+  for(i=0;i<mgr->num;i++) {
+    lcd = mgr->dev[i];
+
+    MUTEX_LOCK(&lcd->lock);
+    pending += lcd->queue_head - lcd->queue_tail + lcd_pipeline_pending(lcd);
+    ms = lcd_mgr_events(lcd, 0);
+    MUTEX_UNLOCK(&lcd->lock);
+
+    if((ms >= 0) && ((timeout < 0) || (ms < timeout)))
+      timeout = ms;
+  }
+
+  if(!pending)
+    return 0;
+
+  if((n = epoll_wait(mgr->epfd, ev, sizeof(ev)/sizeof(ev[0]), timeout)) < 0) {
+    perror("epoll_wait");
+    return -1;
+  }
+
+  /* and process them, the round trip time of emulated devices */
+  /* may have passed meanwhile as well */
+  for(i=0;i<n;i++) {
+    lcd = ev[i].data.ptr;
+
+    MUTEX_LOCK(&lcd->lock);
+    lcd_mgr_events(lcd, 1);
+    MUTEX_UNLOCK(&lcd->lock);
+  }
+
+  pending = 0;
+  for(i=0;i<mgr->num;i++) {
+    lcd = mgr->dev[i];
+
+    MUTEX_LOCK(&lcd->lock);
+    if(lcd->emu_fd >= 0)
+      lcd_mgr_events(lcd, 0);
+    pending += lcd->queue_head - lcd->queue_tail + lcd_pipeline_pending(lcd);
+    MUTEX_UNLOCK(&lcd->lock);
+  }
+
+  return pending;
+}
+
+int lcd2usb_manager_flush(lcd2usb_manager_t *mgr) {
+  int i, ret;
+
+  for(i=0;i<mgr->num;i++) {
+    MUTEX_LOCK(&mgr->dev[i]->lock);
+    lcd_flush(mgr->dev[i]);
+    MUTEX_UNLOCK(&mgr->dev[i]->lock);
+  }
+
+  while((ret = lcd2usb_manager_run(mgr, -1)) > 0);
+
+  return ret;
+}
+#endif
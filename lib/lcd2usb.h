@@ -0,0 +1,315 @@
+/*
+ * lcd2usb.h - library interface to the lcd2usb interface
+ *             http://www.harbaum.org/till/lcd2usb
+ *
+ * All state of a device is kept in an opaque lcd2usb_t context, so
+ * several devices can be driven from one process. The functions of
+ * one context may be called from different threads, calls are
+ * serialized by a lock inside the context.
+ *
+ * Unless noted otherwise functions return 0 on success and -1 on
+ * failure.
+ */
+
+#ifndef LCD2USB_H
+#define LCD2USB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* vendor and product id */
+#define LCD2USB_VID            0x0403
+#define LCD2USB_PID            0xc630
+
+/* controller bitmap for lcd2usb_command() and lcd2usb_data() */
+#define LCD2USB_CTRL_0         (1<<3)
+#define LCD2USB_CTRL_1         (1<<4)
+#define LCD2USB_BOTH           (LCD2USB_CTRL_0 | LCD2USB_CTRL_1)
+
+/* lcd2usb_fade() options */
+#define LCD2USB_FADE_CONTRAST   0x00
+#define LCD2USB_FADE_BRIGHTNESS 0x01
+#define LCD2USB_FADE_GAMMA      0x02   /* perceptually even ramp */
+
+typedef struct lcd2usb lcd2usb_t;
+
+/* a change of the key state as reported by the device */
+struct lcd2usb_key_event {
+  int keys;             /* key bitmap after the event */
+  int changed;          /* bitmap of keys that changed */
+  int lost;             /* events have been lost before this one */
+  unsigned int time;    /* device time of the first edge in ms, 16 bit */
+};
+
+/* optional protocol features, see lcd2usb_get_caps() */
+#define LCD2USB_FEATURE_LONG        0x0001  /* long transfers */
+#define LCD2USB_FEATURE_KEY_EVENTS  0x0002  /* lcd2usb_get_key_event() */
+#define LCD2USB_FEATURE_QUEUE_STATE 0x0004  /* lcd2usb_get_queue() */
+#define LCD2USB_FEATURE_FADE        0x0008  /* lcd2usb_fade() */
+#define LCD2USB_FEATURE_PERSIST     0x0010  /* lcd2usb_set_persist_delay() */
+#define LCD2USB_FEATURE_FB          0x0020  /* lcd2usb_write_cells() */
+#define LCD2USB_FEATURE_GOTO        0x0040  /* address command and data */
+#define LCD2USB_FEATURE_MIXED       0x0080  /* commands and data mixed */
+#define LCD2USB_FEATURE_TIMED       0x0100  /* lcd2usb_set_timed() */
+#define LCD2USB_FEATURE_TICKER      0x0200  /* lcd2usb_ticker() */
+#define LCD2USB_FEATURE_MACROS      0x0400  /* lcd2usb_macro_store() */
+
+/* what a device supports and the state it was in when it was opened */
+struct lcd2usb_caps {
+  int version;          /* as returned by lcd2usb_get_version() */
+  int features;         /* bitmap of LCD2USB_FEATURE_* */
+  int ctrl;             /* bitmap of installed controllers */
+  int queue;            /* entries of the device's command queue, 0 = none */
+  int long_max;         /* max bytes per long transfer, 0 = none */
+  int contrast;         /* 0 to 255, -1 if unknown */
+  int brightness;       /* 0 to 255, -1 if unknown */
+  int keys;             /* bitmap of pressed keys */
+};
+
+/* identifies a device independent of the order of enumeration */
+struct lcd2usb_info {
+  char path[32];        /* bus and port numbers, e.g. "1-1.4" */
+  char serial[64];      /* serial number string, empty if there's none */
+};
+
+struct lcd2usb_stats {
+  long transfers;       /* usb control transfers issued */
+  long fb_cost_naive;   /* update planner: cost of jumping to every run */
+  long fb_cost_planned; /* update planner: cost of the planned updates */
+  long glyph_hits;      /* glyph cache: glyphs found in cgram */
+  long glyph_misses;    /* glyph cache: glyphs uploaded */
+  long queue_overflows; /* short request entries the device dropped */
+};
+
+/* ----------------------------- devices ------------------------------ */
+
+/* open the first lcd2usb device found, returns NULL if there's none */
+extern lcd2usb_t *lcd2usb_open(void);
+
+/* fill info with up to max devices, returns the number of devices found */
+extern int lcd2usb_list(struct lcd2usb_info *info, int max);
+
+/* open the device at the given path as returned by lcd2usb_list() */
+extern lcd2usb_t *lcd2usb_open_path(const char *path);
+
+extern void lcd2usb_get_info(lcd2usb_t *lcd, struct lcd2usb_info *info);
+
+#ifndef WIN
+/* start the firmware emulator (see firmware/emu) with the given shell */
+/* command instead of using a real device. Every transfer takes at */
+/* least latency us */
+extern lcd2usb_t *lcd2usb_open_emu(const char *cmd, int latency);
+#endif
+
+/* send all pending output and release the device */
+extern void lcd2usb_close(lcd2usb_t *lcd);
+
+/* ---------------------------- transfers ----------------------------- */
+
+/* number of output transfers in flight, 1 = blocking (default 8) */
+extern int lcd2usb_set_depth(lcd2usb_t *lcd, int depth);
+
+/* use long transfers, enabled by default if the firmware supports them */
+extern int lcd2usb_set_long(lcd2usb_t *lcd, int enable);
+
+/* send buffered output and wait for all transfers to complete */
+extern int lcd2usb_flush(lcd2usb_t *lcd);
+
+extern void lcd2usb_get_stats(lcd2usb_t *lcd, struct lcd2usb_stats *stats);
+
+/* number of transfers that haven't completed yet */
+extern int lcd2usb_pending(lcd2usb_t *lcd);
+
+/* ------------------------- device requests -------------------------- */
+
+/* returns the value echoed by the device or -1 */
+extern int lcd2usb_echo(lcd2usb_t *lcd, int value);
+
+/* returns major version in the lsb and minor version in the msb */
+extern int lcd2usb_get_version(lcd2usb_t *lcd);
+
+/* returns bitmap of installed controllers, bit 0 = CTRL0, bit 1 = CTRL1 */
+extern int lcd2usb_get_controller(lcd2usb_t *lcd);
+
+/* returns bitmap of pressed keys */
+extern int lcd2usb_get_keys(lcd2usb_t *lcd);
+
+/* capabilities and state as read when the device was opened, no */
+/* transfer is needed. Firmware 1.11 and later reports all of them in */
+/* a single request, older firmware is asked for them one by one */
+extern void lcd2usb_get_caps(lcd2usb_t *lcd, struct lcd2usb_caps *caps);
+
+/* returns the number of free entries in the device's command queue */
+/* and how often it was full since the last call */
+extern int lcd2usb_get_queue(lcd2usb_t *lcd, int *overflows);
+
+/* wait up to timeout ms for the next key event. Returns 1 if an event */
+/* has been received, 0 on timeout and -1 on error */
+extern int lcd2usb_get_key_event(lcd2usb_t *lcd,
+				 struct lcd2usb_key_event *ev, int timeout);
+
+/* contrast and brightness from 0 to 255 */
+extern int lcd2usb_set_contrast(lcd2usb_t *lcd, int value);
+extern int lcd2usb_set_brightness(lcd2usb_t *lcd, int value);
+
+/* let the device fade contrast or brightness to value within ms */
+extern int lcd2usb_fade(lcd2usb_t *lcd, int what, int value, int ms);
+
+/* contrast and brightness are saved in the device's eeprom once they */
+/* haven't changed for delay * 100ms (default 2s), 0 disables saving */
+extern int lcd2usb_set_persist_delay(lcd2usb_t *lcd, int delay);
+
+/* save contrast and brightness right now */
+extern int lcd2usb_save_settings(lcd2usb_t *lcd);
+
+/* let the device wait for the execution times of the HD44780 data */
+/* sheet instead of reading the busy flag before each write. Clear */
+/* and home are still followed by busy flag reads. Displays with a */
+/* controller clocked slower than 270kHz need the busy flag */
+extern int lcd2usb_set_timed(lcd2usb_t *lcd, int enable);
+
+/* ------------------------------ display ------------------------------ */
+
+/* HD44780 instruction and data bytes, see the HD44780 datasheet */
+extern int lcd2usb_command(lcd2usb_t *lcd, int ctrl, int cmd);
+extern int lcd2usb_data(lcd2usb_t *lcd, int ctrl, int data);
+
+extern int lcd2usb_clear(lcd2usb_t *lcd);
+extern int lcd2usb_home(lcd2usb_t *lcd);
+
+/* write a string at the cursor position of the first controller */
+extern int lcd2usb_write(lcd2usb_t *lcd, const char *str);
+
+/* write len cells of the DDRAM starting at cell (line * 40 + column) */
+/* through the framebuffer of the device: only cells that differ from */
+/* what the display shows are written to it, so whole frames may be */
+/* sent each time. Needs firmware 1.11 or later */
+extern int lcd2usb_write_cells(lcd2usb_t *lcd, int ctrl, int cell,
+			       const unsigned char *data, int len);
+
+/* ---------------------------- framebuffer ---------------------------- */
+
+/* The library keeps a copy of the display contents. Applications draw */
+/* into a frame buffer and lcd2usb_fb_commit() only transmits the cells */
+/* that differ from what the display already shows */
+
+/* setup frame buffer for a display with the given controller map */
+/* (as returned by lcd2usb_get_controller() or found in the caps) */
+/* and the given size. Four line displays with a single controller */
+/* may have up to 20 columns */
+extern int lcd2usb_fb_init(lcd2usb_t *lcd, int ctrl, int rows, int cols);
+
+/* fill the frame buffer with blanks */
+extern void lcd2usb_fb_clear(lcd2usb_t *lcd);
+
+/* draw a string into the frame buffer, clipped at the line end */
+extern void lcd2usb_fb_print(lcd2usb_t *lcd, int row, int col,
+			     const char *str);
+
+/* draw a user defined 5x8 glyph, given as 8 rows of 5 bits each. Up */
+/* to eight different glyphs can be shown at a time, they are */
+/* uploaded into the display's CGRAM only if they aren't there yet */
+extern int lcd2usb_fb_glyph(lcd2usb_t *lcd, int row, int col,
+			    const unsigned char *glyph);
+
+/* forget everything known about the display contents */
+extern void lcd2usb_fb_invalidate(lcd2usb_t *lcd);
+
+/* the display has been cleared by other means */
+extern void lcd2usb_fb_blank(lcd2usb_t *lcd);
+
+/* transmit the changes, returns the number of cells written or -1 */
+extern int lcd2usb_fb_commit(lcd2usb_t *lcd);
+
+/* let text scroll through a row of the frame buffer from right to */
+/* left, wrapping around at its end. An empty text stops the marquee. */
+/* The row is redrawn by every step, whatever else is printed there */
+extern int lcd2usb_marquee(lcd2usb_t *lcd, int row, const char *text);
+
+/* move all marquees one character and commit the frame buffer. The */
+/* display shift is used where it's cheaper than rewriting the rows. */
+/* It moves all lines of a controller, so other rows shown by the */
+/* same controller are then rewritten as needed. Returns the number */
+/* of cells written or -1 */
+extern int lcd2usb_marquee_step(lcd2usb_t *lcd);
+
+/* let the device scroll up to 80 characters of text through width */
+/* cells of a row starting at col by itself, one character every ms */
+/* milliseconds, so nothing has to be sent while it runs. 0 ms shows */
+/* the text without scrolling, an empty text stops the ticker. The */
+/* frame buffer doesn't draw into the window and doesn't shift the */
+/* display of its controller, page flips fail while a ticker runs. */
+/* There's one ticker per device, a new one replaces the previous */
+/* one. Needs firmware 1.11 or later */
+extern int lcd2usb_ticker(lcd2usb_t *lcd, int row, int col, int width,
+			  const char *text, int ms);
+
+/* Displays with up to 20 columns (10 on four line displays with a */
+/* single controller) show less than half of each DDRAM line. The */
+/* frame can be written into the invisible part while the current */
+/* page stays on screen and then be shown at once by moving the */
+/* display window. The previous page is kept, so flipping back to it */
+/* doesn't need to send it again */
+
+/* write the frame into the hidden page, returns the number of cells */
+/* written or -1 if the display is too wide */
+extern int lcd2usb_page_render(lcd2usb_t *lcd);
+
+/* render what's still missing and flip the hidden page into view, */
+/* returns the number of cells written or -1 */
+extern int lcd2usb_page_flip(lcd2usb_t *lcd);
+
+/* ------------------------------- macros ------------------------------ */
+
+/* Sequences of commands and data can be stored in the device's eeprom */
+/* and later be written to the display with a single request, e.g. to */
+/* set up user defined characters or to redraw a screen layout */
+
+#define LCD2USB_MACRO_SLOTS    4
+#define LCD2USB_MACRO_DATA     0x100    /* entry of seq is data */
+
+/* store len commands, or data bytes or'ed with LCD2USB_MACRO_DATA, */
+/* in one of the slots. The macro takes a byte per entry plus one per */
+/* run of commands or data and may take up to 125 bytes. Each byte */
+/* that changes takes 8.5ms to store, the call returns once all of */
+/* them have been stored. Needs firmware 1.11 or later */
+extern int lcd2usb_macro_store(lcd2usb_t *lcd, int slot, const int *seq,
+			       int len);
+
+/* write a stored macro to the given controllers, an empty slot writes */
+/* nothing. Commands and data sent afterwards are written after it */
+extern int lcd2usb_macro_play(lcd2usb_t *lcd, int ctrl, int slot);
+
+/* ------------------------------ manager ------------------------------ */
+
+#ifdef __linux__
+/* A manager drives any number of devices from a single event loop. */
+/* Output to a device added to a manager is queued instead of waiting */
+/* for the device, and lcd2usb_manager_run() submits the queued */
+/* transfers with every device taking its turn. Devices added to a */
+/* manager are closed by lcd2usb_manager_free() */
+typedef struct lcd2usb_manager lcd2usb_manager_t;
+
+extern lcd2usb_manager_t *lcd2usb_manager_new(void);
+extern void lcd2usb_manager_free(lcd2usb_manager_t *mgr);
+
+extern int lcd2usb_manager_add(lcd2usb_manager_t *mgr, lcd2usb_t *lcd);
+
+/* open and add all lcd2usb devices, returns the number of devices added */
+extern int lcd2usb_manager_open_all(lcd2usb_manager_t *mgr);
+
+/* submit queued transfers and wait up to timeout ms (-1 = forever) */
+/* for completions. Returns the number of transfers still pending on */
+/* all devices or -1 */
+extern int lcd2usb_manager_run(lcd2usb_manager_t *mgr, int timeout);
+
+/* run until all output has been sent */
+extern int lcd2usb_manager_flush(lcd2usb_manager_t *mgr);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LCD2USB_H */
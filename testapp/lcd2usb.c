@@ -6,40 +6,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <usb.h>
-
-/* vendor and product id */
-#define LCD2USB_VID  0x0403
-#define LCD2USB_PID  0xc630
-
-/* target is a bit map for CMD/DATA */
-#define LCD_CTRL_0         (1<<3)
-#define LCD_CTRL_1         (1<<4)
-#define LCD_BOTH           (LCD_CTRL_0 | LCD_CTRL_1)
-
-#define LCD_ECHO           (0<<5)
-#define LCD_CMD            (1<<5)
-#define LCD_DATA           (2<<5)
-#define LCD_SET            (3<<5)
-#define LCD_GET            (4<<5)
-
-/* target is value to set */
-#define LCD_SET_CONTRAST   (LCD_SET | (0<<3))
-#define LCD_SET_BRIGHTNESS (LCD_SET | (1<<3))
-#define LCD_SET_RESERVED0  (LCD_SET | (2<<3))
-#define LCD_SET_RESERVED1  (LCD_SET | (3<<3))
-
-/* target is value to get */
-#define LCD_GET_FWVER      (LCD_GET | (0<<3))
-#define LCD_GET_KEYS       (LCD_GET | (1<<3))
-#define LCD_GET_CTRL       (LCD_GET | (2<<3))
-#define LCD_GET_RESERVED1  (LCD_GET | (3<<3))
+#include <sys/time.h>
+
+#include "lcd2usb.h"
 
 #ifdef WIN
 #include <windows.h>
 #include <winbase.h>
 #define MSLEEP(a) Sleep(a)
 #else
+#include <unistd.h>
 #define MSLEEP(a) usleep(a*1000)
 #endif
 
@@ -48,116 +24,26 @@ const char msg[] =
   "The quick brown fox jumps over the lazy dogs back ..."
   "                ";
 
-usb_dev_handle      *handle = NULL;
-
-int lcd_send(int request, int value, int index) {
-  if(usb_control_msg(handle, USB_TYPE_VENDOR, request, 
-		      value, index, NULL, 0, 1000) < 0) {
-    fprintf(stderr, "USB request failed!");
-    return -1;
-  }
-  return 0;
-}
-
-/* to increase performance, a little buffer is being used to */
-/* collect command bytes of the same type before transmitting them */
-#define BUFFER_MAX_CMD 4        /* current protocol supports up to 4 bytes */
-int buffer_current_type = -1;   /* nothing in buffer yet */
-int buffer_current_fill = 0;    /* -"- */
-unsigned char buffer[BUFFER_MAX_CMD];
-
-/* command format:
- * 7 6 5 4 3 2 1 0
- * C C C T T R L L
- *
- * TT = target bit map
- * R = reserved for future use, set to 0
- * LL = number of bytes in transfer - 1
- */
-
-/* flush command queue due to buffer overflow / content */
-/* change or due to explicit request */
-void lcd_flush(void) {
-  int request, value, index;
-  
-  /* anything to flush? ignore request if not */
-  if (buffer_current_type == -1)
-    return;
-  
-  /* build request byte */
-  request = buffer_current_type | (buffer_current_fill - 1);
-  
-  /* fill value and index with buffer contents. endianess should IMHO not */
-  /* be a problem, since usb_control_msg() will handle this. */
-  value = buffer[0] | (buffer[1] << 8);
-  index = buffer[2] | (buffer[3] << 8);
-  
-  /* send current buffer contents */
-  lcd_send(request, value, index);
-  
-  /* buffer is now free again */
-  buffer_current_type = -1;
-  buffer_current_fill = 0;
-}
-
-/* enqueue a command into the buffer */
-void lcd_enqueue(int command_type, int value) {
-  if ((buffer_current_type >= 0) && (buffer_current_type != command_type))
-    lcd_flush();
-  
-  /* add new item to buffer */
-  buffer_current_type = command_type;
-  buffer[buffer_current_fill++] = value;
-  
-  /* flush buffer if it's full */
-  if (buffer_current_fill == BUFFER_MAX_CMD)
-    lcd_flush();
-}
-
-/* see HD44780 datasheet for a command description */
-void lcd_command(const unsigned char ctrl, const unsigned char cmd) {
-  lcd_enqueue(LCD_CMD | ctrl, cmd);
-}
-
-/* clear display */
-void lcd_clear(void) {
-  lcd_command(LCD_BOTH, 0x01);    /* clear display */
-  lcd_command(LCD_BOTH, 0x03);    /* return home */
-}
-
-/* home display */
-void lcd_home(void) {
-  lcd_command(LCD_BOTH, 0x03);    /* return home */
-}
-
-/* write a data string to the first display */
-void lcd_write(const char *data) {
-  int ctrl = LCD_CTRL_0;
-  
-  while(*data) 
-    lcd_enqueue(LCD_DATA | ctrl, *data++);
-  
-  lcd_flush();
-}
+/* 60 characters ticker text */
+const char ticker[] =
+  "+++ LCD2USB +++ USB to HD44780 interface +++ (c) Till H.    ";
 
 /* send a number of 16 bit words to the lcd2usb interface */
 /* and verify that they are correctly returned by the echo */
 /* command. This may be used to check the reliability of */
 /* the usb interfacing */
 #define ECHO_NUM 100
-void lcd_echo(void) {
+void lcd_echo(lcd2usb_t *lcd) {
 
-  int i, nBytes, errors=0;
-  unsigned short val, ret;
+  int i, ret, errors=0;
+  unsigned short val;
 
   for(i=0;i<ECHO_NUM;i++) {
     val = rand() & 0xffff;
     
-    nBytes = usb_control_msg(handle, 
-	   USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-	   LCD_ECHO, val, 0, (char*)&ret, sizeof(ret), 1000);
+    ret = lcd2usb_echo(lcd, val);
 
-    if(nBytes < 0) {
+    if(ret < 0) {
       fprintf(stderr, "USB request failed!");
       return;
     }
@@ -173,111 +59,557 @@ void lcd_echo(void) {
     printf("Echo test successful!\n");
 }
 
-/* get a value from the lcd2usb interface */
-int lcd_get(unsigned char cmd) {
-  unsigned char       buffer[2];
-  int                 nBytes;
+/* print what the library has learned about the interface when */
+/* opening it: firmware version, installed LCD controllers (none, */
+/* CTRL0 for single and CTRL0 and CTRL1 for dual controller */
+/* displays) and the state of the two optional buttons */
+void lcd_get_caps(lcd2usb_t *lcd, struct lcd2usb_caps *caps) {
+  lcd2usb_get_caps(lcd, caps);
+
+  printf("Firmware version %d.%d\n", caps->version&0xff, caps->version>>8);
+  printf("Features: 0x%04x, %d queue entries, %d bytes per long transfer\n",
+	 caps->features, caps->queue, caps->long_max);
+
+  if(caps->ctrl)
+    printf("Installed controllers: %s%s\n", 
+	   (caps->ctrl&1)?"CTRL0":"",
+	   (caps->ctrl&2)?" CTRL1":"");
+  else
+    printf("No controllers installed!\n");
+
+  if(caps->contrast >= 0)
+    printf("Contrast: %d, brightness: %d\n", caps->contrast, caps->brightness);
+
+  printf("Keys: 0:%s 1:%s\n",
+	 (caps->keys&1)?"on":"off",
+	 (caps->keys&2)?"on":"off");
+}
 
-  /* send control request and accept return value */
-  nBytes = usb_control_msg(handle, 
-	   USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN, 
-	   cmd, 0, 0, (char *)buffer, sizeof(buffer), 1000);
+/* print key events until both keys are pressed at once */
+void lcd_key_events(lcd2usb_t *lcd) {
+  struct lcd2usb_key_event ev;
+  int ret;
 
-  if(nBytes < 0) {
-    fprintf(stderr, "USB request failed!");
-    return -1;
+  printf("Waiting for key events, press both keys to quit\n");
+
+  while((ret = lcd2usb_get_key_event(lcd, &ev, 1000)) >= 0) {
+    if(!ret)
+      continue;
+
+    printf("%5u.%03u: key 0:%s 1:%s%s\n", ev.time / 1000, ev.time % 1000,
+	   (ev.keys&1)?"on":"off", (ev.keys&2)?"on":"off",
+	   ev.lost?" (events lost)":"");
+
+    if(ev.keys == 3)
+      break;
+  }
+}
+
+/* draw a horizontal bar of len pixels into a row of the framebuffer */
+/* using user defined glyphs for the partially filled cells */
+void lcd_bar(lcd2usb_t *lcd, int row, int cols, int len) {
+  unsigned char glyph[8];
+  int col, n;
+
+  for(col=0;col<cols;col++) {
+    n = len - col*5;
+
+    if(n <= 0)
+      lcd2usb_fb_print(lcd, row, col, " ");
+    else {
+      if(n > 5) n = 5;
+      memset(glyph, (0x1f << (5-n)) & 0x1f, sizeof(glyph));
+      lcd2usb_fb_glyph(lcd, row, col, glyph);
+    }
   }
+}
+
+/* write a number of characters with the given pipeline depth and */
+/* return the throughput in characters per second */
+#define BENCH_CHARS 1024
+double lcd_bench_run(lcd2usb_t *lcd, int depth) {
+  struct timeval start, end;
+  double secs;
+  int i, overflows;
+
+  lcd2usb_set_depth(lcd, depth);
+  lcd2usb_home(lcd);
 
-  return buffer[0] + 256*buffer[1];
+  /* reset device queue overflow counter */
+  lcd2usb_get_queue(lcd, NULL);
+
+  gettimeofday(&start, NULL);
+
+  for(i=0;i<BENCH_CHARS;i++)
+    lcd2usb_data(lcd, LCD2USB_CTRL_0, 'A' + i%26);
+
+  lcd2usb_flush(lcd);
+
+  gettimeofday(&end, NULL);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec)/1e6;
+
+  /* the device had to write synchronously if its queue was full */
+  if((lcd2usb_get_queue(lcd, &overflows) >= 0) && overflows)
+    printf("Device queue was full %d%s times\n", overflows, 
+	   (overflows == 255)?"+":"");
+
+  return (secs > 0)?BENCH_CHARS/secs:0;
 }
 
-/* get lcd2usb interface firmware version */
-void lcd_get_version(void) {
-  int ver = lcd_get(LCD_GET_FWVER);
+/* send full frames of both ddram lines of the first controller in */
+/* which only a counter changes, either as plain data or through the */
+/* device's framebuffer. Returns the number of frames per second */
+#define BENCH_FRAMES 100
+double lcd_bench_frames(lcd2usb_t *lcd, int cells) {
+  struct timeval start, end;
+  unsigned char frame[81];
+  double secs;
+  int i, j;
+
+  gettimeofday(&start, NULL);
+
+  for(i=0;i<BENCH_FRAMES;i++) {
+    j = sprintf((char*)frame, "Frame %d", i);
+    memset(frame+j, '.', sizeof(frame)-j);
+
+    if(cells) {
+      if(lcd2usb_write_cells(lcd, LCD2USB_CTRL_0, 0, frame, 80) < 0)
+	return -1;
+    } else {
+      lcd2usb_command(lcd, LCD2USB_CTRL_0, 0x80);
+      for(j=0;j<80;j++)
+	lcd2usb_data(lcd, LCD2USB_CTRL_0, frame[j]);
+    }
+  }
+
+  lcd2usb_flush(lcd);
+
+  gettimeofday(&end, NULL);
 
-  if(ver != -1) 
-    printf("Firmware version %d.%d\n", ver&0xff, ver>>8);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec)/1e6;
+  return (secs > 0)?BENCH_FRAMES/secs:0;
 }
 
-/* get the bit mask of installed LCD controllers (0 = no */
-/* lcd found, 1 = single controller display, 3 = dual */
-/* controller display */
-void lcd_get_controller(void) {
-  int ctrl = lcd_get(LCD_GET_CTRL);
-
-  if(ctrl != -1) {
-    if(ctrl)
-      printf("Installed controllers: %s%s\n", 
-	     (ctrl&1)?"CTRL0":"",
-	     (ctrl&2)?" CTRL1":"");
-    else
-      printf("No controllers installed!\n");
+/* update single characters at different places like a clock does */
+/* and return the number of transfers per update */
+#define BENCH_UPDATES 100
+double lcd_bench_scattered(lcd2usb_t *lcd) {
+  struct lcd2usb_stats stats;
+  long transfers;
+  int i;
+
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
+
+  for(i=0;i<BENCH_UPDATES;i++) {
+    lcd2usb_command(lcd, LCD2USB_CTRL_0, 0x80 | ((i * 7) % 40));
+    lcd2usb_data(lcd, LCD2USB_CTRL_0, '0' + i % 10);
   }
+
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+
+  return (double)(stats.transfers - transfers) / BENCH_UPDATES;
 }
 
-/* get state of the two optional buttons */
-void lcd_get_keys(void) {
-  int keymask = lcd_get(LCD_GET_KEYS);
+/* characters alternating with cursor moves: every other cell is */
+/* written. Returns the number of transfers per character */
+double lcd_bench_interleaved(lcd2usb_t *lcd) {
+  struct lcd2usb_stats stats;
+  long transfers;
+  int i;
+
+  lcd2usb_command(lcd, LCD2USB_CTRL_0, 0x80);
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
+
+  for(i=0;i<BENCH_UPDATES;i++) {
+    lcd2usb_data(lcd, LCD2USB_CTRL_0, '0' + i % 10);
+    lcd2usb_command(lcd, LCD2USB_CTRL_0, 0x14);  // cursor right
+  }
+
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
 
-  if(keymask != -1) 
-    printf("Keys: 0:%s 1:%s\n",
-	   (keymask&1)?"on":"off",
-	   (keymask&2)?"on":"off");
+  return (double)(stats.transfers - transfers) / BENCH_UPDATES;
 }
 
-/* set a value in the LCD interface */
-void lcd_set(unsigned char cmd, int value) {
-  if(usb_control_msg(handle, 
-	     USB_TYPE_VENDOR, cmd, value, 0, 
-	     NULL, 0, 1000) < 0) {
-    fprintf(stderr, "USB request failed!");
+/* compare blocking transfers with the transfer pipeline and */
+/* long transfers */
+void lcd_benchmark(lcd2usb_t *lcd, int depth) {
+  double blocking, pipelined, longtr, frames, cells;
+
+  lcd2usb_set_long(lcd, 0);
+  blocking = lcd_bench_run(lcd, 1);
+  pipelined = lcd_bench_run(lcd, depth);
+  printf("Scattered updates:     %8.1f transfers each\n",
+	 lcd_bench_scattered(lcd));
+  printf("Interleaved writes:    %8.2f transfers each\n",
+	 lcd_bench_interleaved(lcd));
+
+  printf("Blocking transfers:    %8.0f chars/sec\n", blocking);
+  printf("Pipelined transfers:   %8.0f chars/sec (%d in flight)\n", 
+	 pipelined, depth);
+
+  if(lcd2usb_set_long(lcd, 1) == 0) {
+    longtr = lcd_bench_run(lcd, 1);
+    printf("Long transfers:        %8.0f chars/sec\n", longtr);
+    longtr = lcd_bench_run(lcd, depth);
+    printf("Pipelined long:        %8.0f chars/sec (%d in flight)\n", 
+	   longtr, depth);
+    printf("Interleaved long:      %8.2f transfers each\n",
+	   lcd_bench_interleaved(lcd));
+
+    /* the device doesn't read the busy flag between the writes */
+    if(lcd2usb_set_timed(lcd, 1) == 0) {
+      longtr = lcd_bench_run(lcd, depth);
+      lcd2usb_set_timed(lcd, 0);
+      printf("Timed long:            %8.0f chars/sec (%d in flight)\n", 
+	     longtr, depth);
+    }
   }
+
+  /* the device only writes the cells that changed */
+  frames = lcd_bench_frames(lcd, 0);
+  cells = lcd_bench_frames(lcd, 1);
+  printf("Full frames:           %8.0f frames/sec\n", frames);
+  if(cells >= 0)
+    printf("Device framebuffer:    %8.0f frames/sec\n", cells);
 }
 
-/* set contrast to a value between 0 and 255. Result depends */
-/* display type */
-void lcd_set_contrast(int value) {
-  lcd_set(LCD_SET_CONTRAST, value);
+/* compare page flips with redrawing the whole screen */
+#define PAGE_FLIPS 6
+
+void lcd_page(lcd2usb_t *lcd, int page) {
+  lcd2usb_fb_print(lcd, 0, 0, page?" -- page two -- ":"Page one: flip  ");
+  lcd2usb_fb_print(lcd, 1, 0, page?"back and forth  ":"to the next one ");
 }
 
-/* set backlight brightness to a value between 0 (off) anf 255 */
-void lcd_set_brightness(int value) {
-  lcd_set(LCD_SET_BRIGHTNESS, value);
+int lcd_pages(lcd2usb_t *lcd) {
+  struct lcd2usb_stats stats;
+  long transfers, render = 0, flip = 0, redraw;
+  int i, n, cells = 0, redraw_cells = 0;
+
+  for(i=0;i<PAGE_FLIPS;i++) {
+    lcd_page(lcd, i&1);
+
+    lcd2usb_get_stats(lcd, &stats);
+    transfers = stats.transfers;
+    if((n = lcd2usb_page_render(lcd)) < 0)
+      return -1;
+    cells += n;
+
+    lcd2usb_get_stats(lcd, &stats);
+    render += stats.transfers - transfers;
+    transfers = stats.transfers;
+    lcd2usb_page_flip(lcd);
+
+    lcd2usb_get_stats(lcd, &stats);
+    flip += stats.transfers - transfers;
+    MSLEEP(500);
+  }
+
+  /* the same with a commit redrawing the screen each time */
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
+
+  for(i=0;i<PAGE_FLIPS;i++) {
+    lcd_page(lcd, i&1);
+    redraw_cells += lcd2usb_fb_commit(lcd);
+    MSLEEP(500);
+  }
+
+  lcd2usb_get_stats(lcd, &stats);
+  redraw = stats.transfers - transfers;
+
+  printf("Page flip: %.1f transfers, rendering ahead %.1f transfers "
+	 "and %d cells\n", (double)flip / PAGE_FLIPS, 
+	 (double)render / PAGE_FLIPS, cells);
+  printf("Redraw:    %.1f transfers, %d cells\n", 
+	 (double)redraw / PAGE_FLIPS, redraw_cells);
+
+  return 0;
 }
 
-int main(int argc, char *argv[]) {
-  struct usb_bus      *bus;
-  struct usb_device   *dev;
+/* send a sequence of commands and data, returns the transfers it took */
+long lcd_seq(lcd2usb_t *lcd, const int *seq, int n) {
+  struct lcd2usb_stats stats;
+  long transfers;
   int i;
+
+  lcd2usb_clear(lcd);
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
+
+  for(i=0;i<n;i++) {
+    if(seq[i] & LCD2USB_MACRO_DATA)
+      lcd2usb_data(lcd, LCD2USB_CTRL_0, seq[i] & 0xff);
+    else
+      lcd2usb_command(lcd, LCD2USB_CTRL_0, seq[i]);
+  }
+  lcd2usb_flush(lcd);
+
+  lcd2usb_get_stats(lcd, &stats);
+  MSLEEP(500);
+  return stats.transfers - transfers;
+}
+
+/* a screen layout stored as a macro in the device and redrawn from */
+/* there, compared to sending the same commands and data each time */
+/* with and without long transfers */
+int lcd_macro(lcd2usb_t *lcd) {
+  struct lcd2usb_stats stats;
+  const char *line[2] = { "Temp:     C", "Load:     %" };
+  int seq[64], n = 0, i, l;
+  long transfers, plain, longs;
+
+  for(l=0;l<2;l++) {
+    seq[n++] = 0x80 | (l?0x40:0);    /* set ddram address */
+    for(i=0;line[l][i];i++)
+      seq[n++] = LCD2USB_MACRO_DATA | line[l][i];
+  }
+
+  /* only the bytes that differ from the stored macro are written */
+  if(lcd2usb_macro_store(lcd, 0, seq, n) < 0)
+    return -1;
+
+  lcd2usb_set_long(lcd, 0);
+  plain = lcd_seq(lcd, seq, n);
+  lcd2usb_set_long(lcd, 1);
+  longs = lcd_seq(lcd, seq, n);
+
+  lcd2usb_clear(lcd);
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
+  lcd2usb_macro_play(lcd, LCD2USB_CTRL_0, 0);
+  lcd2usb_flush(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  MSLEEP(500);
+
+  printf("Macro: %ld transfer instead of %ld short requests or %ld long "
+	 "transfer for %d commands and data\n", stats.transfers - transfers, 
+	 plain, longs, n);
+
+  return 0;
+}
+
+#ifdef __linux__
+/* drive a number of devices at once from the event loop of a */
+/* lcd2usb manager. Every device gets MULTI_UPDATES screen updates */
+/* and a new one is started as soon as the previous one is done */
+#define MULTI_UPDATES 50
+#define MULTI_CHARS   32
+#define MULTI_MAX     64
+
+struct multi_dev {
+  lcd2usb_t *lcd;
+  int updates;                    /* updates started */
+  int busy;                       /* an update is in progress */
+  struct timeval start;           /* start of current update */
+  double lat[MULTI_UPDATES];      /* latency of each update in ms */
+};
+
+double lcd_ms(struct timeval *start, struct timeval *end) {
+  return (end->tv_sec - start->tv_sec)*1e3 + 
+    (end->tv_usec - start->tv_usec)/1e3;
+}
+
+int lcd_double_cmp(const void *a, const void *b) {
+  double d = *(const double*)a - *(const double*)b;
+  return (d > 0) - (d < 0);
+}
+
+/* percentile p of n sorted values */
+double lcd_percentile(double *v, int n, int p) {
+  return v[(n-1) * p / 100];
+}
+
+void lcd_multi_benchmark(int num, char *emu, int latency, int depth) {
+  static struct multi_dev dev[MULTI_MAX];
+  static double all[MULTI_MAX * MULTI_UPDATES];
+  struct lcd2usb_info info[MULTI_MAX];
+  struct timeval connect, first, start, end, now;
+  lcd2usb_manager_t *mgr;
+  double best = -1, worst = -1, p;
+  char str[MULTI_CHARS+1];
+  int i, j, n = 0, done;
+
+  if(!(mgr = lcd2usb_manager_new()))
+    return;
+
+  if(num > MULTI_MAX) num = MULTI_MAX;
+
+  /* connect-to-first-frame time includes opening the devices */
+  gettimeofday(&connect, NULL);
+
+  /* open emulated devices or all devices found */
+  if(!emu && ((num = lcd2usb_list(info, num)) > MULTI_MAX))
+    num = MULTI_MAX;
+
+  for(i=0;i<num;i++) {
+    lcd2usb_t *lcd = emu?lcd2usb_open_emu(emu, latency):
+      lcd2usb_open_path(info[i].path);
+
+    if(!lcd)
+      continue;
+
+    lcd2usb_set_depth(lcd, depth);
+    if(lcd2usb_manager_add(mgr, lcd) < 0) {
+      lcd2usb_close(lcd);
+      continue;
+    }
+
+    lcd2usb_get_info(lcd, &info[n]);
+    printf("Device %d: %s%s%s\n", n, info[n].path, 
+	   info[n].serial[0]?" serial ":"", info[n].serial);
+
+    memset(&dev[n], 0, sizeof(dev[n]));
+    dev[n++].lcd = lcd;
+  }
+
+  if(!n) {
+    fprintf(stderr, "Error: Could not find LCD2USB device\n");
+    lcd2usb_manager_free(mgr);
+    return;
+  }
+
+  gettimeofday(&start, NULL);
+
+  do {
+    done = 1;
+    gettimeofday(&now, NULL);
+
+    for(i=0;i<n;i++) {
+      struct multi_dev *d = &dev[i];
+
+      if(d->busy && !lcd2usb_pending(d->lcd)) {
+	d->lat[d->updates-1] = lcd_ms(&d->start, &now);
+	d->busy = 0;
+
+	if(d->updates == 1)
+	  first = now;
+      }
+
+      if(!d->busy && (d->updates < MULTI_UPDATES)) {
+	/* each update writes a full line of new text */
+	j = sprintf(str, "%02d:%03d ", i, d->updates);
+	for(;j<MULTI_CHARS;j++)
+	  str[j] = 'A' + (d->updates + j) % 26;
+	str[j] = 0;
+
+	d->start = now;
+	lcd2usb_home(d->lcd);
+	lcd2usb_write(d->lcd, str);
+	d->updates++;
+	d->busy = 1;
+      }
+
+      if(d->busy)
+	done = 0;
+    }
+  } while(!done && (lcd2usb_manager_run(mgr, 10) >= 0));
+
+  gettimeofday(&end, NULL);
+
+  for(i=0;i<n;i++) {
+    memcpy(all + i*MULTI_UPDATES, dev[i].lat, sizeof(dev[i].lat));
+    qsort(dev[i].lat, MULTI_UPDATES, sizeof(double), lcd_double_cmp);
+
+    p = lcd_percentile(dev[i].lat, MULTI_UPDATES, 99);
+    if(best < 0 || p < best) best = p;
+    if(worst < 0 || p > worst) worst = p;
+  }
+  qsort(all, n*MULTI_UPDATES, sizeof(double), lcd_double_cmp);
+
+  printf("Devices:               %8d\n", n);
+  printf("First frames:          %8.1f ms after connecting\n",
+	 lcd_ms(&connect, &first));
+  printf("Aggregate throughput:  %8.0f chars/sec\n", 
+	 n * MULTI_UPDATES * MULTI_CHARS / (lcd_ms(&start, &end)/1e3));
+  printf("Update latency:        p50 %.1fms, p90 %.1fms, p99 %.1fms, "
+	 "max %.1fms\n",
+	 lcd_percentile(all, n*MULTI_UPDATES, 50),
+	 lcd_percentile(all, n*MULTI_UPDATES, 90),
+	 lcd_percentile(all, n*MULTI_UPDATES, 99),
+	 all[n*MULTI_UPDATES-1]);
+  printf("Per device p99:        best %.1fms, worst %.1fms\n", best, worst);
+
+  lcd2usb_manager_free(mgr);
+}
+#endif
+
+void usage(char *name) {
+  printf("Usage: %s [-b] [-k] [-m num] [-d depth] [-e emulator [-l latency]]\n",
+	 name);
+  printf("  -b        run transfer benchmark\n");
+  printf("  -k        print key events\n");
+#ifdef __linux__
+  printf("  -m num    drive num devices (emulated or all found) at once\n");
+#endif
+  printf("  -d depth  number of transfers in flight (1 = blocking)\n");
+#ifndef WIN
+  printf("  -e cmd    use emulated device started by cmd, e.g.\n");
+  printf("            -e ../firmware/emu/lcd2usb-emu\n");
+  printf("  -l us     simulated usb round trip time of the emulated device\n");
+#endif
+}
+
+int main(int argc, char *argv[]) {
+  struct lcd2usb_caps caps;
+  int i, bench = 0, keys = 0, multi = 0, depth = 8;
+  char *emu = NULL;
+  int emu_latency = 0;
+  struct lcd2usb_stats stats;
+  long transfers;
+  lcd2usb_t *lcd;
   
   printf("--      LCD2USB test application       --\n");
   printf("--      (c) 2006 by Till Harbaum       --\n");
   printf("-- http://www.harbaum.org/till/lcd2usb --\n");
 
-  usb_init();
-  
-  usb_find_busses();
-  usb_find_devices();
-  
-  for(bus = usb_get_busses(); bus; bus = bus->next) {
-    for(dev = bus->devices; dev; dev = dev->next) {
-      if((dev->descriptor.idVendor == LCD2USB_VID) && 
-	 (dev->descriptor.idProduct == LCD2USB_PID)) {
-	
-	printf("Found LCD2USB device on bus %s device %s.\n", 
-	       bus->dirname, dev->filename);
-	
-	/* open device */
-	if(!(handle = usb_open(dev))) 
-	  fprintf(stderr, "Error: Cannot open USB device: %s\n", 
-		  usb_strerror());
-
-	break;
-      }
+  for(i=1;i<argc;i++) {
+    if(!strcmp(argv[i], "-b"))
+      bench = 1;
+    else if(!strcmp(argv[i], "-k"))
+      keys = 1;
+#ifdef __linux__
+    else if(!strcmp(argv[i], "-m") && (i+1 < argc))
+      multi = atoi(argv[++i]);
+#endif
+    else if(!strcmp(argv[i], "-d") && (i+1 < argc))
+      depth = atoi(argv[++i]);
+#ifndef WIN
+    else if(!strcmp(argv[i], "-e") && (i+1 < argc))
+      emu = argv[++i];
+    else if(!strcmp(argv[i], "-l") && (i+1 < argc))
+      emu_latency = atoi(argv[++i]);
+#endif
+    else {
+      usage(argv[0]);
+      exit(-1);
     }
   }
-  
-  if(!handle) {
+
+#ifdef __linux__
+  if(multi) {
+    lcd_multi_benchmark(multi, emu, emu_latency, depth);
+    return 0;
+  }
+#endif
+
+#ifndef WIN
+  if(emu)
+    lcd = lcd2usb_open_emu(emu, emu_latency);
+  else
+#endif
+    lcd = lcd2usb_open();
+
+  if(!lcd) {
     fprintf(stderr, "Error: Could not find LCD2USB device\n");
 
 #ifdef WIN
@@ -288,50 +620,139 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
+  lcd2usb_set_depth(lcd, depth);
+
   /* make lcd interface return some bytes to */
   /* test transfer reliability */
-  lcd_echo();
+  lcd_echo(lcd);
 
-  /* read some values from adaptor */
-  lcd_get_version();
-  lcd_get_controller();
-  lcd_get_keys();
+  if(bench) {
+    lcd_benchmark(lcd, depth);
+    lcd2usb_close(lcd);
+    return 0;
+  }
+
+  if(keys) {
+    lcd_key_events(lcd);
+    lcd2usb_close(lcd);
+    return 0;
+  }
+
+  /* the values read from the adaptor when it was opened */
+  lcd_get_caps(lcd, &caps);
 
   /* adjust contrast and brightess */
-  lcd_set_contrast(200);
-  lcd_set_brightness(255);
+  lcd2usb_set_contrast(lcd, 200);
+  lcd2usb_set_brightness(lcd, 255);
 
   /* clear display */
-  lcd_clear();
+  lcd2usb_clear(lcd);
+
+  /* write something on the screen, the framebuffer only */
+  /* transmits the characters that actually changed */
+  lcd2usb_fb_init(lcd, caps.ctrl?caps.ctrl:1, 2, 16);
+  lcd2usb_fb_blank(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
 
-  /* write something on the screen */
   for(i=0;i<strlen(msg)-15;i++) {
     char tmp_str[17];
     strncpy(tmp_str, msg+i, 16);  /* copy 16 chars */
     tmp_str[16] = 0;              /* terminate string */
 
     /* write string to display */
-    lcd_home();
-    lcd_write(tmp_str);
+    lcd2usb_fb_print(lcd, 0, 0, tmp_str);
+    lcd2usb_fb_commit(lcd);
 
     MSLEEP(100);
   }
 
-  /* have some fun with the brightness */
-  for(i=255;i>=0;i--) {
-    lcd_set_brightness(i);
-    MSLEEP(10);
+  lcd2usb_get_stats(lcd, &stats);
+  printf("Scrolling took %ld transfers\n", stats.transfers - transfers);
+  printf("Update planner: %ld %s instead of %ld\n", stats.fb_cost_planned, 
+	 (caps.features & LCD2USB_FEATURE_LONG)?"bytes":"transfers",
+	 stats.fb_cost_naive);
+
+  /* a ticker. The display shift moves the characters already in */
+  /* ddram, so only the one entering the screen has to be sent */
+  lcd2usb_fb_clear(lcd);
+  lcd2usb_marquee(lcd, 0, ticker);
+  lcd2usb_fb_commit(lcd);
+  lcd2usb_get_stats(lcd, &stats);
+  transfers = stats.transfers;
+
+  for(i=0;i<strlen(ticker);i++) {
+    lcd2usb_marquee_step(lcd);
+    MSLEEP(100);
+  }
+
+  lcd2usb_marquee(lcd, 0, "");
+  lcd2usb_get_stats(lcd, &stats);
+  printf("Marquee: %.1f transfers per step\n",
+	 (double)(stats.transfers - transfers) / strlen(ticker));
+
+  /* the same text scrolled by the device itself, nothing has to */
+  /* be sent for it while the bar graph is drawn below */
+  if(caps.features & LCD2USB_FEATURE_TICKER) {
+    lcd2usb_get_stats(lcd, &stats);
+    transfers = stats.transfers;
+    lcd2usb_ticker(lcd, 0, 0, 16, ticker, 100);
+    lcd2usb_get_stats(lcd, &stats);
+    printf("Device ticker: %ld transfers to start\n", 
+	   stats.transfers - transfers);
+  }
+
+  /* a bar graph, each of its six glyphs is uploaded only once */
+  for(i=0;i<=160;i+=2) {
+    lcd_bar(lcd, 1, 16, (i < 80)?i:160-i);
+    lcd2usb_fb_commit(lcd);
+
+    MSLEEP(20);
   }
 
-  lcd_clear();
-  lcd_write("Bye bye!!!");
+  if(caps.features & LCD2USB_FEATURE_TICKER)
+    lcd2usb_ticker(lcd, 0, 0, 16, "", 0);
+
+  lcd2usb_get_stats(lcd, &stats);
+  printf("Bar graph: %ld glyph uploads, %ld glyph cache hits\n", 
+	 stats.glyph_misses, stats.glyph_hits);
+
+  /* two pages shown alternately. Each is written into the */
+  /* invisible part of the ddram and then flipped into view, */
+  /* afterwards both stay there and flips don't send them again */
+  if(lcd_pages(lcd) < 0)
+    printf("Display too wide for page flipping\n");
+
+  /* a layout redrawn by the device from its eeprom */
+  if(caps.features & LCD2USB_FEATURE_MACROS)
+    lcd_macro(lcd);
+
+  /* have some fun with the brightness. Newer firmware does the */
+  /* fade itself */
+  if(caps.features & LCD2USB_FEATURE_FADE) {
+    lcd2usb_fade(lcd, LCD2USB_FADE_BRIGHTNESS | LCD2USB_FADE_GAMMA, 0, 2560);
+    MSLEEP(2560);
+  } else {
+    for(i=255;i>=0;i--) {
+      lcd2usb_set_brightness(lcd, i);
+      MSLEEP(10);
+    }
+  }
+
+  lcd2usb_clear(lcd);
+  lcd2usb_write(lcd, "Bye bye!!!");
   
-  for(i=0;i<=255;i++) {
-    lcd_set_brightness(i);
-    MSLEEP(10);
+  if(caps.features & LCD2USB_FEATURE_FADE) {
+    lcd2usb_fade(lcd, LCD2USB_FADE_BRIGHTNESS | LCD2USB_FADE_GAMMA, 255, 2560);
+    MSLEEP(2560);
+  } else {
+    for(i=0;i<=255;i++) {
+      lcd2usb_set_brightness(lcd, i);
+      MSLEEP(10);
+    }
   }
 
-  usb_close(handle);
+  lcd2usb_close(lcd);
 
 #ifdef WIN
   printf("Press return to quit\n");